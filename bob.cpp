@@ -14,6 +14,7 @@ using namespace std;
 const int DEFAULT_SERVER_PORT = 8000;
 
 const path TEST_DIR = path(__FILE__).parent_path().parent_path() / "examples";
+const int64_t TEST_TIMEOUT_MS = 10 * 60 * 1000;
 
 enum class Action {
     Record,
@@ -29,12 +30,8 @@ size_t term_width() {
 
 vector<path> find_test_cases() {
     vector<path> cases;
-    for (const auto &entry : fs::directory_iterator(TEST_DIR)) {
-        path test_case = entry.path();
-        if (fs::is_directory(test_case)) {
-            if (!fs::exists(test_case / "test.list")) continue;
-            cases.push_back(test_case);
-        }
+    for (const path &list : glob("*/test.list", TEST_DIR)) {
+        cases.push_back(list.parent_path());
     }
     return cases;
 }
@@ -64,9 +61,7 @@ path find_root() {
 int test(CliCommand &cmd, Action action, path test_case = "") {
     cmd.handle_help();
 
-    ensure_installed({"git", "g++", "python3"});
-
-    path root = find_root();
+    ensure_installed({"git", "g++"});
 
     vector<path> test_cases;
     if (!test_case.empty()) {
@@ -79,44 +74,24 @@ int test(CliCommand &cmd, Action action, path test_case = "") {
         }
     }
 
-    CmdRunner runner;
-
-    cout << "\nCleaning test directories..." << endl;
-    runner.clear();
-    for (const path &test_case : test_cases) {
-        runner.push(Cmd({"git", "clean", "-xdf", test_case}));
-    }
-    runner.run();
-    if (runner.any_failed()) {
-        runner.print_failed();
-        return EXIT_FAILURE;
-    }
-
-    cout << "\nCompiling test cases..." << endl;
-    runner.clear();
+    TestRunner tests;
+    tests.timeout_ms = TEST_TIMEOUT_MS; // A hanging test fails instead of blocking the others
     for (const path &test_case : test_cases) {
-        runner.push(Cmd({"g++", "bob.cpp", "-o", "bob"}, test_case));
-    }
-    runner.run();
-    if (runner.any_failed()) {
-        runner.print_failed();
-        return EXIT_FAILURE;
+        // Keep the compiled `bob`, so it is only rebuilt when its sources change
+        Cmd clean({"git", "clean", "-xdf", "-e", "bob", test_case});
+        Recipe compile({test_case / "bob"}, {test_case / "bob.cpp", test_case / "bob.hpp"},
+                       Cmd({"g++", "bob.cpp", "-o", "bob"}, test_case));
+        tests.add(test_case, {clean}, {compile});
     }
 
     cout << "\nRunning tests..." << endl;
-    runner.clear();
-    for (const auto &test_case : test_cases) {
-        path rere_path = fs::relative(root / "rere.py", test_case);
-        runner.push(Cmd({
-                    "python3",
-                    rere_path,
-                    (action == Action::Record) ? "record" : "replay",
-                    "test.list"}, test_case));
-    }
-    runner.capture_output(true);
-    runner.run();
+    bool ok = (action == Action::Record) ? tests.record() : tests.replay();
 
-    if (runner.all_succeded()) {
+    if (ok) {
+        if (action == Action::Replay) {
+            cout << endl;
+            tests.print_timings(5);
+        }
         cout << term::GREEN << term::BOLD;
         if (action == Action::Record) cout << "\nOutput recorded successfully!";
         else                          cout << "\nAll tests succeeded!";
@@ -126,30 +101,23 @@ int test(CliCommand &cmd, Action action, path test_case = "") {
 
     // Something went wrong...
 
-    // Collect failed commands
-    vector<Cmd *> failed_cmds;
-    for (int i = 0; i < runner.size(); i++) {
-        auto &cmd       = runner.cmds[i];
-        auto &exit_code = runner.exit_codes[i];
-        if (exit_code != 0) {
-            failed_cmds.push_back(&cmd);
-        }
-    }
-
     size_t w = term_width();
 
     cout << endl;
-    for (auto cmd : failed_cmds) {
-        label(w, cmd->render(), term::RED);
-        cout << cmd->output_str << endl;
+    size_t passed = 0;
+    for (const auto &result : tests.results) {
+        if (result.passed) {
+            passed++;
+            continue;
+        }
+        label(w, result.dir.filename().string() + ": " + result.shell, term::RED);
+        cout << result.message << endl;
     }
     line(w, term::RED);
 
-    // TODO: ?/? tests passed
-    cout << term::RED << "\nSome commands failed:" << endl;
-
-    for (auto cmd : failed_cmds) {
-        cout << "    " << cmd->render() << endl;
+    cout << term::RED << "\n" << passed << "/" << tests.results.size() << " tests passed, these failed:" << endl;
+    for (const auto &result : tests.results) {
+        if (!result.passed) cout << "    " << result.dir.string() << ": " << result.shell << endl;
     }
 
     cout << term::RESET;
@@ -157,6 +125,199 @@ int test(CliCommand &cmd, Action action, path test_case = "") {
     return EXIT_FAILURE;
 }
 
+struct BenchResult {
+    string name;
+    double value;
+    string unit;
+};
+
+using bench_clock = chrono::steady_clock;
+
+double seconds_since(bench_clock::time_point start) {
+    return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+void report(vector<BenchResult> &results, const string &name, double value, const string &unit) {
+    cout << "    " << left << setw(40) << setfill(' ') << name << right << setw(14) << fixed << setprecision(2) << value << " " << unit << endl;
+    results.push_back({name, value, unit});
+}
+
+Cmd quiet(Cmd cmd) {
+    cmd.echo = false;
+    cmd.silent = true;
+    return cmd;
+}
+
+void bench_spawn(vector<BenchResult> &results, size_t runs) {
+    vector<double> times;
+    for (size_t i = 0; i < runs; ++i) {
+        auto start = bench_clock::now();
+        quiet(Cmd({"true"})).run();
+        times.push_back(seconds_since(start) * 1e6);
+    }
+    sort(times.begin(), times.end());
+    double total = 0;
+    for (double t : times) total += t;
+    report(results, "spawn.mean", total / times.size(), "us");
+    report(results, "spawn.p50", times[times.size() / 2], "us");
+    report(results, "spawn.p95", times[times.size() * 95 / 100], "us");
+}
+
+void bench_runner(vector<BenchResult> &results, size_t jobs) {
+    size_t nproc = thread::hardware_concurrency();
+    vector<size_t> process_counts = {1, 4, nproc, 2 * nproc};
+    sort(process_counts.begin(), process_counts.end());
+    process_counts.erase(unique(process_counts.begin(), process_counts.end()), process_counts.end());
+    for (size_t process_count : process_counts) {
+        CmdRunner runner(process_count);
+        for (size_t i = 0; i < jobs; ++i) runner.push(quiet(Cmd({"true"})));
+        auto start = bench_clock::now();
+        runner.run();
+        report(results, "runner.j" + to_string(process_count), jobs / seconds_since(start), "jobs/s");
+    }
+}
+
+void bench_queue(vector<BenchResult> &results, size_t commands) {
+    // Compile-sized command lines, so copies of the parts show up in the numbers
+    vector<string> flags;
+    for (size_t i = 0; i < 32; ++i) flags.push_back("-Isome/include/directory/number-" + to_string(i));
+
+    vector<Cmd> cmds;
+    cmds.reserve(commands);
+    for (size_t i = 0; i < commands; ++i) {
+        Cmd cmd({"cc", "-c", "src/file-" + to_string(i) + ".c"});
+        cmd.push_many(flags);
+        cmds.push_back(std::move(cmd));
+    }
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    auto start = bench_clock::now();
+    CmdRunner runner;
+    runner.push_many(std::move(cmds));
+    report(results, "queue.push_many", seconds_since(start) * 1000, "ms");
+
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    report(results, "queue.peak_rss_growth", (after.ru_maxrss - before.ru_maxrss) / 1024.0, "MB");
+}
+
+void bench_needs_rebuild(vector<BenchResult> &results, const path &dir, size_t files) {
+    path inputs_dir = dir / "inputs";
+    Paths inputs;
+    mkdirs(inputs_dir);
+    for (size_t i = 0; i < files; ++i) {
+        path input = inputs_dir / ("file-" + to_string(i) + ".c");
+        if (!fs::exists(input)) ofstream(input) << i << "\n";
+        inputs.push_back(input);
+    }
+    path output = dir / "output";
+    ofstream(output) << "up to date\n";
+
+    Recipe recipe({output}, inputs, [](const Paths &, const Paths &) {});
+
+    stat_cache().clear();
+    auto start = bench_clock::now();
+    recipe.needs_rebuild();
+    report(results, "needs_rebuild.cold", seconds_since(start) * 1000, "ms");
+
+    start = bench_clock::now();
+    recipe.needs_rebuild();
+    report(results, "needs_rebuild.cached", seconds_since(start) * 1000, "ms");
+}
+
+void bench_capture(vector<BenchResult> &results, size_t megabytes) {
+    double bytes = megabytes * 1024.0 * 1024.0;
+
+    Cmd stream = quiet(Cmd({"head", "-c", to_string(megabytes) + "M", "/dev/zero"}));
+    size_t received = 0;
+    stream.on_output = [&received](std::string_view chunk) { received += chunk.size(); };
+    auto start = bench_clock::now();
+    stream.run();
+    report(results, "capture.stream", bytes / seconds_since(start) / 1e6, "MB/s");
+    if (received != (size_t) bytes) WARNING("Only received " + to_string(received) + " bytes of output");
+
+    Cmd capture = quiet(Cmd({"head", "-c", to_string(megabytes) + "M", "/dev/zero"}));
+    capture.capture_output = true;
+    capture.output_limit = 1 << 20;
+    start = bench_clock::now();
+    capture.run();
+    report(results, "capture.limited", bytes / seconds_since(start) / 1e6, "MB/s");
+}
+
+void bench_startup(vector<BenchResult> &results, const path &dir, size_t runs) {
+    path source = dir / "startup.cpp";
+    ofstream(source)
+        << "#define BOB_IMPLEMENTATION\n"
+        << "#include \"" << fs::absolute(path(__FILE__).parent_path() / "bob.hpp").string() << "\"\n"
+        << "int main(int argc, char *argv[]) {\n"
+        << "    GO_REBUILD_YOURSELF(argc, argv);\n"
+        << "    return 0;\n"
+        << "}\n";
+    path program = dir / "startup";
+    if (quiet(Cmd({"g++", "-o", program, source})).run() != 0) PANIC("Could not compile startup benchmark.");
+
+    vector<double> times;
+    for (size_t i = 0; i < runs; ++i) {
+        auto start = bench_clock::now();
+        quiet(Cmd({program}, dir)).run();
+        times.push_back(seconds_since(start) * 1000);
+    }
+    sort(times.begin(), times.end());
+    report(results, "startup.p50", times[times.size() / 2], "ms");
+}
+
+int bench(CliCommand &cmd) {
+    cmd.handle_help();
+    ensure_installed({"g++", "head", "true"});
+
+    bool quick = cmd.find_long("quick")->set;
+    auto output_arg = cmd.find_long("output");
+    path output = output_arg->set ? path(output_arg->value) : path("bench.json");
+
+    path dir = fs::temp_directory_path() / "bob-bench";
+    mkdirs(dir);
+
+    vector<BenchResult> results;
+
+    cout << term::BOLD << "\nSpawn latency of Cmd::run()" << term::RESET << endl;
+    bench_spawn(results, quick ? 100 : 1000);
+
+    cout << term::BOLD << "\nCmdRunner throughput" << term::RESET << endl;
+    bench_runner(results, quick ? 1000 : 10000);
+
+    cout << term::BOLD << "\nCmdRunner queueing" << term::RESET << endl;
+    bench_queue(results, quick ? 10000 : 50000);
+
+    cout << term::BOLD << "\nRecipe::needs_rebuild()" << term::RESET << endl;
+    bench_needs_rebuild(results, dir, quick ? 10000 : 100000);
+
+    cout << term::BOLD << "\nOutput capture" << term::RESET << endl;
+    bench_capture(results, quick ? 100 : 1024);
+
+    cout << term::BOLD << "\nGO_REBUILD_YOURSELF startup" << term::RESET << endl;
+    bench_startup(results, dir, quick ? 10 : 50);
+
+    // One JSON object per line, so results are easy to append and compare over time
+    ofstream out(output);
+    if (!out.is_open()) PANIC("Could not open file '" + output.string() + "' for writing.");
+    auto timestamp = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    for (const auto &result : results) {
+        out << "{\"name\": \"" << result.name << "\", \"value\": " << result.value
+            << ", \"unit\": \"" << result.unit << "\", \"quick\": " << (quick ? "true" : "false")
+            << ", \"time\": " << timestamp << "}\n";
+    }
+    cout << "\nResults written to " << output << endl;
+
+    return EXIT_SUCCESS;
+}
+
+void add_bench_command(Cli &cli) {
+    cli.add_command("bench", "Benchmark the overhead of bob itself", bench)
+        .add_flag('q', "quick", CliFlagType::Bool, "Run smaller benchmarks")
+        .add_flag('o', "output", CliFlagType::Value, "File to write the results to as JSON lines (default: bench.json)");
+}
+
 const string CODE_MARKER = "```";
 const string DOCS_MARKER = "//!";
 
@@ -407,41 +568,28 @@ int serve(CliCommand &cmd) {
             root / "docs" / "Doxyfile",
             root / "README.mdx",
         };
-        vector<fs::file_time_type> stats = {};
+        FileWatcher watcher;
 
-        // Initialize stats for each path
         cout << "Watching for changes in: " << endl;
         path cwd = fs::current_path();
         for (const auto &p : watch_paths) {
             cout << "    ./" << fs::relative(p, cwd).string() << endl;
-            auto mtime = fs::last_write_time(p);
-            stats.push_back(mtime);
+            watcher.add(p);
         }
 
-        assert(watch_paths.size() == stats.size());
-
-        // Event loop to watch for changes
+        // Event loop to watch for changes. The timeout keeps relaying the server output.
         for (bool done = false; !done;) {
-            bool change_detected = false;
-
-            for (int i = 0; i < watch_paths.size(); i++) {
-                path &p = watch_paths[i];
-                auto &mtime = stats[i];
-                auto new_mtime = fs::last_write_time(p);
-                if (mtime == new_mtime) continue; // No change
+            Paths changed = watcher.wait(100);
 
+            for (const auto &p : changed) {
                 cout << "Change detected in " << p.string() << ", rebuilding documentation..." << endl;
-                change_detected = true;
-                mtime = new_mtime; // Update the last modified time
             }
 
-            if (change_detected) {
+            if (!changed.empty()) {
                 document(cmd);
             }
 
             server_fut.poll();
-
-            std::this_thread::sleep_for(chrono::milliseconds(20));
         }
     }
 
@@ -476,8 +624,10 @@ int main(int argc, char* argv[]) {
     GO_REBUILD_YOURSELF(argc, argv);
 
     Cli cli("Task CLI for the bob.hpp project", argc, argv);
+    cli.add_trace_flag();
 
     add_test_commands(cli);
+    add_bench_command(cli);
     add_doc_commands(cli);
     add_readme_command(cli);
 
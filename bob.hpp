@@ -25,6 +25,8 @@
 #ifndef BOB_H_
 #define BOB_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <iostream>
@@ -34,12 +36,39 @@
 #include <thread>
 #include <functional>
 #include <cassert>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <exception>
+#include <stdexcept>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <chrono>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <pty.h>
+#include <utmp.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <spawn.h>
+#include <dirent.h>
+#include <fnmatch.h>
 
 namespace fs = std::filesystem;
 
@@ -53,15 +82,117 @@ namespace bob {
         #define BOB_REBUILD_CMD { "g++", "-o", "_PROGRAM_", "_SOURCE_" }
     #endif
 
+    //! Object file the implementation of bob is compiled into once, so rebuilds only compile the
+    //! source file and link. Define it as `""` to compile everything on every rebuild.
+    #ifndef BOB_REBUILD_OBJECT
+        #define BOB_REBUILD_OBJECT ".bob/bob.o"
+    #endif
+
     //! Macro to rebuild and rerun the current executable from its source code if needed.
     //! The new executable  will be run with the same arguments as the current one.
     //! This function is best used at the beginning of the `main` function.
-    #define GO_REBUILD_YOURSELF(argc, argv) bob::go_rebuild_yourself(argc, argv, __FILE__, bob::RebuildConfig(BOB_REBUILD_CMD))
+    #define GO_REBUILD_YOURSELF(argc, argv) bob::go_rebuild_yourself(argc, argv, __FILE__, bob::RebuildConfig(BOB_REBUILD_CMD, BOB_REBUILD_OBJECT))
 
     // Forward declarations
     class Cmd;
     class CliCommand;
 
+    //! A function that receives command output as it is read.
+    typedef std::function<void(std::string_view)> OutputFunc;
+
+    //! An in-process task run by a `Cmd`. It appends its output to `output` and returns its exit code.
+    typedef std::function<int(string &output)> TaskFunc;
+
+    //! How the process of a command is spawned.
+    enum class SpawnMode {
+        //! Run the command in a pseudo-terminal, so tools keep colored and line buffered output.
+        Pty,
+        //! Run the command with plain pipes using `posix_spawn`. This is cheaper to launch,
+        //! but tools may disable colors since their output is not a terminal.
+        Pipe,
+    };
+
+    //! The end of a command's output, kept in a ring buffer once the output exceeds half of its limit.
+    struct OutputTail {
+        //! The kept bytes.
+        string data = "";
+        //! Position of the oldest byte in `data`.
+        size_t pos = 0;
+        //! Total number of bytes that went into the tail.
+        size_t total = 0;
+    };
+
+    //! Resources used by a command, as reported by `wait4`.
+    struct CmdStats {
+        //! Wall clock time from spawning the command until it was reaped, in milliseconds.
+        double wall_ms = 0;
+        //! CPU time spent in user mode, in milliseconds.
+        double user_ms = 0;
+        //! CPU time spent in the kernel, in milliseconds.
+        double sys_ms = 0;
+        //! Peak resident memory in kilobytes.
+        long max_rss_kb = 0;
+        //! Number of blocks read from the file system.
+        long read_blocks = 0;
+        //! Number of blocks written to the file system.
+        long write_blocks = 0;
+    };
+
+    //! \brief Records a timeline of the build in the Chrome trace format.
+    //!
+    //! When enabled, every command is recorded with its spawn, first output and exit time, its
+    //! `CmdRunner` slot, exit code and peak memory use, and recipes record their dirty check and
+    //! build as spans. The trace is written when the program exits and can be opened in
+    //! `chrome://tracing` or https://ui.perfetto.dev.
+    //!
+    //! The tracer is enabled with `use_tracer()`, by setting the `BOB_TRACE` environment variable
+    //! to the output file, or with the `--trace <file>` flag of a `Cli` (see `Cli::add_trace_flag()`).
+    //!
+    //! @par Example
+    //! ```cpp
+    //! use_tracer("build-trace.json");
+    //! Cmd({"gcc", "-c", "main.c", "-o", "main.o"}).run();
+    //! ```
+    class Tracer {
+        std::mutex mutex;
+        //! Recorded events as JSON objects.
+        vector<string> events;
+        //! Which command lanes are in use.
+        vector<bool> lanes;
+        std::chrono::steady_clock::time_point epoch;
+    public:
+        //! Process id of command events in the trace.
+        static const int COMMANDS = 1;
+        //! Process id of recipe events in the trace.
+        static const int RECIPES = 2;
+
+        //! The file the trace is written to.
+        path file;
+
+        //! Create a tracer which writes to `file`.
+        Tracer(path file);
+        //! Writes the trace.
+        ~Tracer();
+        //! Microseconds since the tracer was created.
+        int64_t now() const;
+        //! Reserves a lane for a command, so commands never overlap on the same lane.
+        int acquire_lane();
+        //! Frees a lane reserved with `acquire_lane()`.
+        void release_lane(int lane);
+        //! Records a span from `start` to `end` (in microseconds, see `now()`) on lane `tid` of `pid`.
+        //! `args` are extra JSON members, e.g. `"exit_code": 0`.
+        void span(const string &name, const string &category, int64_t start, int64_t end, int pid, int tid, const string &args = "");
+        //! Writes the trace to `file`.
+        void write();
+    };
+
+    //! Enables the global tracer writing to `file` and returns it.
+    Tracer &use_tracer(path file = "bob-trace.json");
+
+    //! Returns the global tracer, or `nullptr` if tracing is not enabled.
+    //! On the first call, the `BOB_TRACE` environment variable is checked.
+    Tracer *tracer();
+
     //! \brief Configuration for rebuilding the current executable.
     //!
     //! This class allows specifying how to rebuild the current executable
@@ -95,24 +226,35 @@ namespace bob {
         //! A vector of strings representing the command parts before substitution.
         vector<string> parts;
 
+        //! Object file the implementation of bob is compiled into, or empty to compile it with the source.
+        //!
+        //! The object is only recompiled when `bob.hpp` or the command changes. The source is then
+        //! compiled with `BOB_EXTERNAL_IMPLEMENTATION` defined and linked with the object. Other
+        //! source files and linker flags in `parts` are only passed to this second command.
+        path object = "";
+
         //! Create an empty rebuild configuration.
         RebuildConfig() = default;
 
-        //! Create a rebuild configuration with the given parts.
-        RebuildConfig(vector<string> &&parts) : parts(std::move(parts)) {}
+        //! Create a rebuild configuration with the given parts and optional implementation object.
+        RebuildConfig(vector<string> &&parts, path object = "") : parts(std::move(parts)), object(object) {}
 
         //! Create a `Cmd` object from this configuration. The `_PROGRAM_` and `_SOURCE_` placeholders
         //! will be replaced with the provided `program` and `source` arguments.
         Cmd cmd(string source = "bob.cpp", string program = "bob") const;
+
+        //! Builds `program` from `source`, compiling the implementation into `object` first if needed.
+        void build(string source = "bob.cpp", string program = "bob") const;
     };
 
     //! Rebuilds the current executable from its source file. After building the new executable,
     //! it will run the new executable with the same arguments as the current one. This function
     //! is called with `GO_REBUILD_YOURSELF(argc, argv)` macro which provides the `source_file_name`
     //! argument automatically.
-    void go_rebuild_yourself(int argc, char* argv[], path source_file_name);
+    void go_rebuild_yourself(int argc, char* argv[], path source_file_name, RebuildConfig config = RebuildConfig());
 
-    //! Runs the current executable and returns the exit status.
+    //! Replaces the current process with the executable `bin`, passing on the arguments.
+    //! If the executable cannot be executed in place, it is run as a child process and its exit status is returned.
     //! This is used in the `go_rebuild_yourself(int argc, char * argv[], path source_file_name)` function.
     int run_yourself(fs::path bin, int argc, char* argv[]);
 
@@ -133,6 +275,16 @@ namespace bob {
     #define PANIC(msg) bob::_panic(__FILE__, __LINE__, msg)
     #define WARNING(msg) bob::_warning(__FILE__, __LINE__, msg)
 
+    //! \brief Thrown instead of exiting when a recipe fails while a `Graph` builds it.
+    //!
+    //! Recipes run on worker threads, where exiting would tear down the global state the other
+    //! workers still use. While a graph builds a recipe, `PANIC` (and with it `Cmd::check()`)
+    //! throws this instead. `Graph::build()` exits with its message after the workers are joined.
+    class BuildError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
     //! \cond DO_NOT_DOCUMENT
     [[noreturn]] void _panic(path file, int line, string msg);
     void _warning(path file, int line, string msg);
@@ -168,6 +320,9 @@ namespace bob {
 
     //! Searches for a binary in the system $PATH variable.
     //!
+    //! Every directory in $PATH is listed at most once and results are cached for the whole
+    //! process, until $PATH changes. Commands are started through the same cache.
+    //!
     //! @param bin_name The name of the binary to search for.
     //! @return The path to the binary if found, otherwise an empty path.
     //!
@@ -231,6 +386,68 @@ namespace bob {
     //! ```
     bool git_root(path * root);
 
+    //! Exit code of a command that was killed because it exceeded its `Cmd::timeout_ms`, like `timeout(1)`.
+    const int TIMEOUT_EXIT_CODE = 124;
+
+    //! \brief A work-stealing pool of threads for running functions in parallel.
+    //!
+    //! Every thread has its own queue. Functions submitted from a thread of the pool go to the
+    //! front of its own queue, other functions are spread over the queues round robin. Idle threads
+    //! take from the front of their own queue and steal from the back of the others.
+    //!
+    //! `CmdRunner` runs in-process tasks (see `Cmd(TaskFunc, string)`) on the pool from `thread_pool()`.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! std::atomic<int> sum = 0;
+    //! ThreadPool pool(4);
+    //! for (int i = 1; i <= 100; i++) pool.submit([&sum, i] { sum += i; });
+    //! pool.wait();
+    //! std::cout << sum << std::endl; // prints: 5050
+    //! ```
+    class ThreadPool {
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> functions;
+        };
+        vector<std::unique_ptr<Queue>> queues;
+        vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        size_t queued = 0;
+        size_t active = 0;
+        size_t next_queue = 0;
+        bool stopping = false;
+
+        //! Takes a function from queue `index` or steals one from another queue.
+        bool take(size_t index, std::function<void()> &function);
+        //! Main loop of thread `index`.
+        void work(size_t index);
+    public:
+        //! Starts a pool with `threads` threads.
+        ThreadPool(size_t threads = std::thread::hardware_concurrency());
+        //! Runs the remaining functions and joins the threads.
+        ~ThreadPool();
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        //! Returns the number of threads in the pool.
+        size_t size() const;
+
+        //! Queues `function` to run on a thread of the pool.
+        void submit(std::function<void()> function);
+
+        //! Blocks until every submitted function has finished. Must not be called from the pool itself.
+        void wait();
+    };
+
+    //! Returns the shared thread pool used for in-process tasks, with one thread per core.
+    ThreadPool &thread_pool();
+
+    //! State shared between an in-process task and its `CmdFuture`.
+    struct TaskState;
+
     //! Represents a command that being executed in the background.
     struct CmdFuture {
         //! Process ID of the child process.
@@ -241,20 +458,81 @@ namespace bob {
         int exit_code;
         //! File descriptor for reading the command's output (stdout and stderr).
         int output_fd;
+        //! True when the command has closed its output and `output_fd` has nothing more to read.
+        bool output_eof = false;
+        //! File descriptor for reading the command's stderr when it is kept separate from stdout, otherwise -1.
+        int error_fd = -1;
+        //! True when the command has closed its stderr and `error_fd` has nothing more to read.
+        bool error_eof = false;
+        //! File descriptor (pidfd) which becomes readable when the child process exits.
+        //! It is -1 if the system does not support pidfds.
+        int exit_fd = -1;
         //! If true, the command's output will not be printed to stdout while it is running.
         bool silent = false;
+        //! Maximum number of bytes of captured output. When the output is larger, the first and
+        //! last half of the limit are kept. Zero keeps everything.
+        size_t output_limit = 0;
+        //! Called with every chunk of output as it is read.
+        OutputFunc on_output = nullptr;
+        //! End of the captured output when it exceeds `output_limit`.
+        OutputTail tail;
+        //! End of the captured stderr when it exceeds `output_limit`.
+        OutputTail error_tail;
+        //! Index of the `CmdRunner` slot running the command, or -1.
+        int slot = -1;
+        //! Time the command was spawned.
+        std::chrono::steady_clock::time_point started;
+        //! Maximum run time in milliseconds, after which `poll()` kills the command, or 0 for no limit.
+        int64_t timeout_ms = 0;
+        //! True if the command was killed because it ran longer than `timeout_ms`.
+        bool timed_out = false;
+        //! Resources used by the command. Valid once it has completed or was killed, e.g. after a timeout.
+        CmdStats stats;
+        //! Name of the command in the trace.
+        string trace_name = "";
+        //! Lane of the command in the trace, or -1 when not tracing.
+        int trace_lane = -1;
+        //! Time the command was spawned, in microseconds of the tracer.
+        int64_t trace_start = 0;
+        //! Time of the first output, in microseconds of the tracer, or -1.
+        int64_t trace_first_output = -1;
+        //! Process group of the command, which contains every stage of a pipeline.
+        pid_t pgid = -1;
+        //! Process IDs of the earlier stages of a pipeline, -1 once they have been reaped.
+        vector<pid_t> stage_pids = {};
+        //! Exit codes of the earlier stages of a pipeline.
+        vector<int> stage_exit_codes = {};
+        //! State of the in-process task, or nullptr when the command is a process.
+        std::shared_ptr<TaskState> task = nullptr;
 
         CmdFuture();
 
         //! Blocks until the command completes and returns the exit code.
         int await(string * output = nullptr);
 
+        //! Blocks until the command produces output or exits, without using any CPU while waiting.
+        //!
+        //! @param timeout_ms Maximum time to wait in milliseconds. A negative value waits indefinitely.
+        void wait(int timeout_ms = -1) const;
+
         //! Polls the command's output and checks if it has completed.
-        //! Also captures and prints any output.
-        bool poll(string * output = nullptr);
+        //! Also captures and prints any output. If the command's stderr is kept separate,
+        //! it is captured in `error`.
+        bool poll(string * output = nullptr, string * error = nullptr);
+
+        //! Kills the command and every process it started, if it is still running.
+        //! The command then counts as exited with `code`.
+        bool kill(int code = -1);
 
-        //! Kills the command if it is still running.
-        bool kill();
+    private:
+        //! Prints, forwards and captures a chunk of output.
+        void consume(std::string_view chunk, string * output, OutputTail &tail, bool is_error);
+        //! Appends the kept tail of the output after the command completed.
+        void finish_output(string * output, OutputTail &tail);
+        //! Closes all file descriptors of the command.
+        void close_fds();
+        //! Records the command in the trace.
+        void trace();
     };
 
     //! \brief Represents a command to be executed in the operating system shell.
@@ -286,6 +564,17 @@ namespace bob {
     //! ```
     class Cmd {
         vector<string> parts;
+        //! Earlier commands of a pipeline, in order. The output of the last one is piped into this command.
+        vector<Cmd> stages;
+
+        //! Spawns the command line `command` in a pseudo-terminal and returns its pid.
+        pid_t spawn_pty(const vector<string> &command, int &output_fd) const;
+        //! Spawns the command line `command` with pipes and returns its pid. Stderr gets its own pipe when `error_fd` is given.
+        //! The earlier stages of a pipeline are spawned first into the same process group, their pids are stored in `stage_pids`.
+        pid_t spawn_pipe(const vector<string> &command, int &output_fd, int * error_fd, vector<pid_t> &stage_pids) const;
+        //! Moves the arguments to a response file when they are longer than `response_file_limit`.
+        //! Returns the command line to execute, which is `parts` itself when no response file is used.
+        const vector<string> &response_file_parts(vector<string> &storage) const;
     public:
         //! If true, the command's output will be captured.
         bool capture_output = false;
@@ -293,12 +582,84 @@ namespace bob {
         //! If true, the command will not print its output to stdout.
         bool silent = false;
 
+        //! If false, the command line is not printed before the command runs.
+        bool echo = true;
+
         //! The command's output captured during execution (stdout and stderr).
         string output_str = "";
 
+        //! The command's stderr captured during execution when `separate_stderr` is set.
+        string error_str = "";
+
+        //! Resources used by the last run of the command.
+        CmdStats stats;
+
+        //! How the command's process is spawned.
+        SpawnMode spawn = SpawnMode::Pty;
+
+        //! If true, stderr is captured in `error_str` instead of `output_str`. Only used with `SpawnMode::Pipe`.
+        bool separate_stderr = false;
+
+        //! Maximum number of bytes kept in `output_str`. When the output is larger, the first and last
+        //! half of the limit are kept with a marker in between. Zero keeps everything.
+        size_t output_limit = 0;
+
+        //! If set, called with every chunk of output as it is read.
+        OutputFunc on_output = nullptr;
+
+        //! If not empty, the output is streamed to this file as it is read.
+        path output_file = "";
+
         //! The root directory from which the command is executed.
         path root = ".";
 
+        //! Estimated peak memory use of the command in bytes. Used by `CmdRunner::memory_limit()`.
+        size_t memory = 0;
+
+        //! Name of the `CmdRunner` pool the command runs in, or empty for no pool. See `CmdRunner::pool()`.
+        string pool = "";
+
+        //! Kills the command when it runs longer than this many milliseconds, or 0 for no limit.
+        //! A command that timed out exits with `TIMEOUT_EXIT_CODE`.
+        int64_t timeout_ms = 0;
+
+        //! How many times a failed or timed out command is run again before it counts as failed.
+        size_t retries = 0;
+
+        //! Marks the command as safe to run twice at once. A `CmdRunner` with idle slots starts a
+        //! second copy when the command runs well past its duration in the build database,
+        //! and keeps whichever copy succeeds first.
+        bool speculative = false;
+
+        //! Marks the command as only reading `inputs` and only writing `outputs`, so a `CmdRunner`
+        //! may run it on a remote worker (see `RemoteWorkers`). Recipes fill in the inputs and outputs
+        //! of their hermetic commands, including the dependencies found in depfiles.
+        bool hermetic = false;
+
+        //! Files read by a hermetic command, relative to the working directory of bob.
+        vector<path> inputs = {};
+
+        //! Files written by a hermetic command, relative to the working directory of bob.
+        vector<path> outputs = {};
+
+        //! If not empty, stdin is read from this file, like `<` in a shell. Relative paths are
+        //! relative to the working directory of bob, not to `root`. Otherwise stdin is a
+        //! terminal with `SpawnMode::Pty` and `/dev/null` with `SpawnMode::Pipe`.
+        path stdin_file = "";
+
+        //! If not empty, stdout is written straight to this file, like `>` in a shell. bob never
+        //! reads this output, so it is neither printed nor captured. Stderr still is.
+        path stdout_file = "";
+
+        //! If set, the command runs this function on `thread_pool()` instead of starting a process.
+        //! See `Cmd(TaskFunc, string)`.
+        TaskFunc task = nullptr;
+
+        //! When the arguments take up more than this many bytes, they are passed to tools that
+        //! support it (gcc, clang, ld, ar) in a `@file` response file in `.bob/rsp` instead.
+        //! Response files are named by their content and only written when it changes. Zero disables them.
+        size_t response_file_limit = 64 * 1024;
+
         //! Creates an empty command.
         Cmd() = default;
 
@@ -313,6 +674,28 @@ namespace bob {
         //! ```
         Cmd(vector<string> &&parts, path root = ".");
 
+        //! Creates an in-process task that runs `task` on `thread_pool()` instead of a process.
+        //! Tasks share the slots of a `CmdRunner` with processes, so CPU-bound C++ work like code
+        //! generation or hashing runs in parallel with compilers without forking.
+        //! A task that throws fails with the message of the exception as its output.
+        //! Tasks cannot be killed, so `timeout_ms`, `speculative` and `hermetic` do not apply to them.
+        //!
+        //! @param task The function to run. It appends its output to its argument and returns the exit code.
+        //! @param name Name of the task, printed as "TASK: name" and used in traces.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! CmdRunner runner;
+        //! runner.push(Cmd([](string &output) {
+        //!     std::ofstream("version.h") << "#define VERSION 1\n";
+        //!     output += "generated version.h\n";
+        //!     return 0;
+        //! }, "generate version.h"));
+        //! runner.push(Cmd({"echo", "hello"}));
+        //! runner.run();
+        //! ```
+        Cmd(TaskFunc task, string name);
+
         //! Adds a single part (argument or command) to the command.
         //!
         //! @param part The part to add.
@@ -323,7 +706,7 @@ namespace bob {
         //! Cmd cmd;
         //! cmd.push("g++").push("app.c").push("-o").push("app");
         //! ```
-        Cmd& push(const string &part);
+        Cmd& push(string part);
 
         //! Adds multiple string parts to the command.
         //!
@@ -352,6 +735,9 @@ namespace bob {
         //! ```
         string render() const;
 
+        //! Returns the parts of the command.
+        const vector<string> &get_parts() const;
+
         //! Runs the command asynchronously and returns a future object.
         //!
         //! @return A CmdFuture object representing the running command.
@@ -376,14 +762,14 @@ namespace bob {
         //! ```
         int run();
 
-        //! Runs the command and throws if the exit status is not zero.
+        //! Runs the command and panics if the exit status is not zero.
         //!
-        //! @throws std::runtime_error if the command exits with a non-zero status.
+        //! @throws BuildError instead of exiting when called from a recipe built by a `Graph`.
         //!
         //! @par Example
         //! ```cpp
         //! Cmd cmd({"echo", "Hello, World!"});
-        //! cmd.check(); // throws if command failed
+        //! cmd.check(); // exits if command failed
         //! ```
         void check();
 
@@ -430,21 +816,303 @@ namespace bob {
         //! int exit_code = cmd.await_future(fut);
         //! ```
         int await_future(CmdFuture &fut);
+
+        //! Returns the earlier commands of a pipeline, whose output is piped into this command.
+        const vector<Cmd> &get_stages() const;
+
+        friend Cmd operator|(Cmd left, Cmd right);
     };
     //! \example minimal/bob.cpp
 
+    //! Connects the stdout of `left` to the stdin of `right` with a pipe, like `|` in a shell.
+    //!
+    //! The result is a single command that runs every stage at once, so a `CmdRunner` schedules
+    //! the whole pipeline as one job. The data flows from stage to stage through the kernel and
+    //! never passes through bob. The stderr of every stage and the stdout of the last stage are
+    //! the output of the pipeline, and its exit code is that of the last stage that failed, like
+    //! `set -o pipefail`. The `stdin_file` of the first stage and the `stdout_file` of the last
+    //! stage are used for the pipeline, other settings come from the last stage. Pipelines always
+    //! use `SpawnMode::Pipe`.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! Cmd pipeline = Cmd({"seq", "100000"}) | Cmd({"grep", "7"}) | Cmd({"gzip", "-c"});
+    //! pipeline.stdout_file = "sevens.gz";
+    //! int exit_code = pipeline.run();
+    //! ```
+    Cmd operator|(Cmd left, Cmd right);
+
+    //! \brief A GNU make jobserver, which shares one parallelism budget between nested builds.
+    //!
+    //! Every process in the build owns one implicit job slot. Additional slots are tokens (single bytes)
+    //! in a pipe or fifo, which a process reads before starting a job and writes back when it is done.
+    //! When bob is started by `make -jN` (from a recipe marked with `+`), `jobserver()` picks up the
+    //! tokens from `MAKEFLAGS` and all `CmdRunner`s take tokens before launching commands.
+    //! With `use_jobserver()` bob becomes a jobserver itself, so any `make`, `cargo` or `ninja` started
+    //! by its commands shares the same budget.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! use_jobserver(8);
+    //! CmdRunner runner;
+    //! runner.push(Cmd({"make", "-C", "vendor/lib"}));
+    //! runner.push(Cmd({"cargo", "build"}));
+    //! runner.run(); // At most 8 jobs run in total, including the ones started by make and cargo
+    //! ```
+    class Jobserver {
+        std::mutex mutex;
+        //! Private non-blocking file descriptor for reading tokens.
+        int read_fd = -1;
+        //! File descriptor for returning tokens.
+        int write_fd = -1;
+        //! Read end of the pipe of an owned jobserver, which child processes inherit.
+        int pipe_read_fd = -1;
+        //! True if this process created the jobserver.
+        bool owner = false;
+        //! True if the implicit job slot of this process is in use.
+        bool implicit_used = false;
+        //! Number of tokens read from the jobserver and not yet returned.
+        size_t held = 0;
+    public:
+        //! The value of `--jobserver-auth` passed to child processes.
+        string auth = "";
+
+        //! Create a jobserver with `jobs` job slots. Child processes find it through `MAKEFLAGS`.
+        Jobserver(size_t jobs);
+        //! Connect to the jobserver described by `auth`, which is either `R,W` or `fifo:PATH`.
+        Jobserver(const string &auth);
+        ~Jobserver();
+        Jobserver(const Jobserver &) = delete;
+        Jobserver &operator=(const Jobserver &) = delete;
+
+        //! Returns `false` if the jobserver could not be connected.
+        bool valid() const;
+        //! Takes a job slot without blocking. Returns `true` if a slot was acquired.
+        bool try_acquire();
+        //! Returns a job slot acquired with `try_acquire()`.
+        void release();
+        //! File descriptor which becomes readable when a token may be available.
+        int fd() const;
+    };
+
+    //! Makes bob a jobserver with `jobs` job slots, which is shared with all commands it runs.
+    //! If bob is already running under a jobserver, that one is kept and returned.
+    Jobserver &use_jobserver(size_t jobs = sysconf(_SC_NPROCESSORS_ONLN));
+
+    //! Returns the jobserver bob is running under, or `nullptr` if there is none.
+    //! On the first call, `MAKEFLAGS` is checked for a jobserver started by a parent `make`.
+    Jobserver *jobserver();
+
+    //! \brief A pool of remote machines which run hermetic commands over SSH.
+    //!
+    //! Once all local slots of a `CmdRunner` are busy, it sends commands marked `Cmd::hermetic` to free
+    //! workers, so it runs up to its process count plus the job slots of all workers at once.
+    //! Inputs are stored on the workers by content hash, so every version of a file is only shipped once.
+    //! Each command runs in a fresh job directory holding its inputs, and its outputs are copied back.
+    //!
+    //! Workers need `sh`, `tar` and the same tools as the local machine. Inputs with absolute paths,
+    //! like system headers, are expected to exist on the workers. SSH connections to a worker are
+    //! shared through `ControlMaster`, so a remote command costs a few round trips on one connection.
+    //! A remote command is killed on the worker when its connection closes, so timeouts, losing
+    //! speculative copies and interrupts stop it there too.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! use_remote_workers({"build1", "build2/32"}, 16); // 16 slots on build1, 32 on build2
+    //! Cmd compile({"gcc", "-c", "_INPUTS_", "-o", "_OUTPUTS_"});
+    //! compile.hermetic = true;
+    //! Recipe::map({"a.o", "b.o"}, {"a.c", "b.c"}, compile).build();
+    //! ```
+    class RemoteWorkers {
+        struct Worker {
+            string host;
+            size_t slots;
+            size_t running;
+        };
+        std::mutex mutex;
+        vector<Worker> workers;
+        //! Number of remote commands created, used to name their job directories.
+        size_t jobs = 0;
+    public:
+        //! The command which connects to a worker. The host and the remote command are appended.
+        vector<string> ssh = {
+            "ssh", "-o", "BatchMode=yes", "-o", "ControlMaster=auto",
+            "-o", "ControlPath=/tmp/bob-ssh-%C", "-o", "ControlPersist=60",
+        };
+        //! Directory on the workers for shipped inputs and job directories, relative to the home directory.
+        string remote_dir = ".cache/bob";
+
+        //! Create a pool of `hosts`, each running up to `slots` commands at once.
+        //! A host written as `host/N` runs up to `N` commands.
+        RemoteWorkers(const vector<string> &hosts = {}, size_t slots = 1);
+        RemoteWorkers(const RemoteWorkers &) = delete;
+        RemoteWorkers &operator=(const RemoteWorkers &) = delete;
+
+        //! Adds a worker which runs up to `slots` commands at once.
+        void add(const string &host, size_t slots);
+        //! Returns the number of job slots of all workers.
+        size_t capacity();
+        //! Returns the number of free job slots.
+        size_t available();
+        //! Reserves a job slot on the least busy worker. Returns the worker, or -1 if all slots are taken.
+        int acquire();
+        //! Returns a job slot reserved with `acquire()`.
+        void release(int worker);
+        //! Returns the host of a worker.
+        string host(int worker);
+        //! Sets `local` to a command which runs the hermetic `cmd` on `worker`, including shipping
+        //! its inputs and fetching its outputs, and `staged` to its files to `discard()` afterwards.
+        //! Returns false if the inputs could not be staged, e.g. when one is unreadable or changed
+        //! since it was hashed, and `cmd` should run locally.
+        bool remote(const Cmd &cmd, int worker, Cmd &local, path &staged);
+        //! Removes the files staged for a remote command.
+        static void discard(const path &staged);
+        //! Checks if `cmd` is hermetic and all its files are inside the working directory of bob.
+        static bool can_run(const Cmd &cmd);
+    };
+
+    //! Enables the global remote workers with the given `hosts` and returns them. See `RemoteWorkers()`.
+    RemoteWorkers &use_remote_workers(const vector<string> &hosts, size_t slots = 1);
+
+    //! Returns the global remote workers, or `nullptr` if there are none. On the first call,
+    //! `BOB_WORKERS` is checked for a space separated list of workers, e.g. `build1/16 build2/8`.
+    RemoteWorkers *remote_workers();
+
+    //! How a `CmdRunner` prints the output of its commands.
+    enum class OutputMode {
+        //! The output is not printed. Capture it with `CmdRunner::capture_output()` and print it with `CmdRunner::print_failed()`.
+        Silent,
+        //! Complete lines are printed as they arrive, so lines of parallel commands never mix.
+        Lines,
+        //! The output of a command is printed in one piece when it finishes, like ninja does.
+        Jobs,
+    };
+
+    //! \brief The single place where every `CmdRunner` writes to stdout.
+    //!
+    //! Command lines and output are collected in a buffer, which is written with one `write(2)`
+    //! whenever a runner is about to wait for its commands, so a few hundred parallel commands do
+    //! not cost thousands of small writes to a slow terminal or log collector. Lines of different
+    //! commands never mix. On a terminal, a ninja style `[done/total]` status line is kept below
+    //! the output. Elsewhere the output is exactly the same as without the sink.
+    class OutputSink {
+        std::mutex mutex;
+        int fd;
+        bool tty;
+        string buffer;
+        //! Output of running jobs which has not been printed yet.
+        std::unordered_map<size_t, string> pending;
+        size_t next_job = 0;
+        size_t done = 0;
+        size_t total = 0;
+        //! The status line to show, and the one currently on the terminal.
+        string status;
+        string shown;
+        //! Writes the buffer and redraws the status line. Expects `mutex` to be held.
+        void write_locked();
+    public:
+        //! Create a sink writing to `fd`.
+        OutputSink(int fd = STDOUT_FILENO);
+        //! Returns `true` if the sink writes to a terminal and shows a status line.
+        bool is_tty() const;
+        //! Prints complete lines of text, like the command line of a starting job.
+        void print(std::string_view text);
+        //! Adds `count` jobs to the total of the status line.
+        void add_jobs(size_t count);
+        //! Returns the id of a new job, whose output is passed to `job_output()`.
+        size_t begin_job();
+        //! Takes a chunk of output of a running job, with every line prefixed by `prefix`.
+        void job_output(size_t job, std::string_view chunk, OutputMode mode, const string &prefix);
+        //! Prints the rest of the output of a job, or throws it away unless `keep` is set.
+        void end_job(size_t job, OutputMode mode, const string &prefix, bool keep = true);
+        //! Counts a finished job called `name` in the status line.
+        void job_finished(const string &name);
+        //! Counts jobs which will never run, because the build stopped early.
+        void skip_jobs(size_t count);
+        //! Writes everything collected so far.
+        void flush();
+    };
+
+    //! Returns the output sink shared by all `CmdRunner`s.
+    OutputSink &output_sink();
+
+    //! Kills every running command. It neither locks nor allocates, so it can be called from a signal handler.
+    //!
+    //! Commands run in their own process groups, outside of the terminal's foreground process group,
+    //! so a Ctrl-C in the terminal never reaches them. Instead bob kills them on SIGINT, SIGTERM and SIGHUP
+    //! and terminates. A program which installs its own handler for these signals before starting
+    //! its first command keeps that handler, which should call this function.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! signal(SIGINT, [](int) { kill_running_cmds(); _exit(130); });
+    //! ```
+    void kill_running_cmds();
+
     //! A class for running many commands in parallel.
+    //!
+    //! When the build database is enabled (see `use_build_db()`), the runner records how long each
+    //! command took and starts the commands that took longest in earlier runs first.
     class CmdRunner {
 
         //! Internal structure to hold a command and its future.
         struct CmdRunnerSlot {
             CmdFuture fut;
             int index;
-            CmdRunnerSlot() : index{-1} {}
+            //! True if the slot holds a job slot of the jobserver.
+            bool token;
+            //! True if the slot runs a speculative second copy of a command, see `Cmd::speculative`.
+            bool duplicate;
+            //! Output of a duplicate, which only replaces the command's output if the duplicate wins.
+            string output;
+            string error;
+            //! The remote worker running the command, or -1 if it runs locally.
+            int worker;
+            //! The files staged for the remote command, see `RemoteWorkers::discard()`.
+            path staged;
+            //! The job of the command in the output sink.
+            size_t job;
+            CmdRunnerSlot() : index{-1}, token{false}, duplicate{false}, worker{-1}, job{0} {}
         };
 
-        //!  The index of the next command to run.
+        //! The indices of `cmds` in the order they are started.
+        vector<size_t> schedule;
+        //!  The position in `schedule` of the first command that has not been started.
         size_t cursor = 0;
+        //! The number of commands that have been started.
+        size_t launched = 0;
+        //! Whether each command in `cmds` has been started.
+        vector<bool> started;
+        //! Maximum number of running commands for each pool.
+        std::unordered_map<string, size_t> pool_depths;
+        //! Maximum system load average for starting more commands, or 0 for no limit.
+        double load_limit = 0;
+        //! Sum of the memory estimates of running commands that may not be exceeded, or 0 for no limit.
+        size_t memory_budget = 0;
+        //! Amount of available system memory that must be kept free, or 0 for no limit.
+        size_t free_memory = 0;
+        //! True if starting commands was held back by the system load or available memory.
+        bool throttled = false;
+        //! Number of failed commands after which no more commands are started, or 0 for no limit.
+        size_t failure_limit = 0;
+        //! The number of commands that failed in the current run.
+        size_t failures = 0;
+        //! How many times each command in `cmds` has been retried.
+        vector<size_t> attempts;
+        //! Duration of each command in `cmds` in the build database, or -1 if unknown.
+        vector<int64_t> history;
+        //! Milliseconds until a running command becomes a straggler, or -1 if none will.
+        int straggler_wait_ms = -1;
+        //! How the output of the commands is printed.
+        OutputMode mode = OutputMode::Silent;
+        //! If true, output lines are prefixed with the number of their command.
+        bool prefix = false;
+        //! The `Cmd::echo` flag of each command in `cmds`. The runner prints the command lines itself.
+        vector<bool> echoes;
+        //! The number of commands that completed in the current run.
+        size_t finished = 0;
+        //! Returns the prefix of the output lines of command `index`.
+        string output_prefix(size_t index) const;
         //! The number of processes to run concurrently.
         size_t process_count;
         //! A vector of slots, each holding future of a running command.
@@ -453,12 +1121,28 @@ namespace bob {
         void init_slots();
         //! Populate the slots with running commands.
         bool populate_slots();
-        //! Wait for all slots to complete.
+        //! Keeps starting commands and waits until all of them have completed.
         void await_slots();
-        //! Set the exit code for a slot based on its future.
+        //! Set the exit code for a slot based on its future and release its job slot.
         void set_exit_code(CmdRunnerSlot &slot);
         //! Check if there are any commands waiting to be run.
-        bool any_waiting();
+        bool any_waiting() const;
+        //! Orders the commands longest first using the durations in the build database.
+        void plan_schedule();
+        //! Block until any running slot has output or has exited.
+        void wait_slots() const;
+        //! Returns the index of the next command that fits its pool and the memory budget, or -1.
+        //! With `remote_only`, only commands which can run on a remote worker are considered.
+        int next_fitting(bool remote_only = false) const;
+        //! Returns the index of a running speculative command that runs well past its history
+        //! and has no second copy yet, or -1. Also updates `straggler_wait_ms`.
+        int next_straggler();
+        //! Polls the command running in a slot.
+        bool poll_slot(CmdRunnerSlot &slot);
+        //! Frees a slot and returns its job slot to the jobserver.
+        void release_slot(CmdRunnerSlot &slot);
+        //! Returns `true` if the system load and available memory allow starting another command.
+        bool system_free() const;
 
     public:
         //! The commands to be run by this runner.
@@ -466,6 +1150,9 @@ namespace bob {
         //! Exit codes for each command in `cmds`.
         vector<int> exit_codes;
         //! Create a `CmdRunner` with a specified number of processes.
+        //!
+        //! When a jobserver is active (see `jobserver()`), the process count is an upper bound,
+        //! and each command also needs a job slot from the jobserver to start.
         CmdRunner(size_t process_count);
         //! Create a `CmdRunner` with a list of commands.
         //!
@@ -480,9 +1167,9 @@ namespace bob {
         CmdRunner();
         //! Returns the number of commands in the runner.
         size_t size();
-        //! Push a single command to the runner.
+        //! Push a single command to the runner. Pass it with `std::move` to avoid a copy.
         void push(Cmd cmd);
-        //! Push multiple commands to the runner.
+        //! Push multiple commands to the runner. Pass them with `std::move` to avoid copies.
         void push_many(vector<Cmd> cmds);
         //! Clears all commands in the runner for reuse.
         void clear();
@@ -492,16 +1179,332 @@ namespace bob {
         bool all_succeded();
         //! Returns `true` if any command in the runner failed (non-zero exit code).
         bool any_failed();
+        //! Resources used by each command in `cmds`.
+        vector<CmdStats> stats;
         //! Prints the output of all commands that failed.
         void print_failed();
+        //! Prints the `count` slowest and most memory hungry commands, and the total resource use.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! CmdRunner runner;
+        //! runner.push(Cmd({"gcc", "-c", "main.c", "-o", "main.o"}));
+        //! runner.run();
+        //! runner.print_stats(5);
+        //! ```
+        void print_stats(size_t count = 10);
         //! Sets the `capture_output` flag for all commands in the runner.
         void capture_output(bool capture = true);
+        //! Sets the `output_limit` for all commands in the runner.
+        void output_limit(size_t limit);
+
+        //! Limits the number of commands of `pool` that run at the same time, like ninja pools.
+        //!
+        //! When the next command's pool is full, later commands in other pools are started first.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! CmdRunner runner(32);
+        //! runner.pool("link", 2);
+        //! Cmd link({"g++", "-flto", "a.o", "b.o", "-o", "app"});
+        //! link.pool = "link";
+        //! link.memory = (size_t) 4 << 30;
+        //! runner.push(link);
+        //! runner.memory_limit((size_t) 16 << 30);
+        //! runner.max_load(16);
+        //! runner.run();
+        //! ```
+        void pool(const string &name, size_t depth);
+
+        //! Holds back new commands while the system load average is above `load`.
+        //! At least one command is always running.
+        void max_load(double load);
+
+        //! Holds back commands while the sum of the `Cmd::memory` estimates of the running commands
+        //! and the next command would exceed `bytes`. At least one command is always running.
+        void memory_limit(size_t bytes);
+
+        //! Holds back new commands while less than `bytes` of system memory is available.
+        //! At least one command is always running.
+        void min_free_memory(size_t bytes);
+
+        //! Prints the output of the commands while they run, instead of only capturing it.
+        //!
+        //! With `OutputMode::Lines` complete lines are printed as they arrive, with `OutputMode::Jobs`
+        //! the output of every command is printed in one piece when it finishes. If `prefix` is set,
+        //! command lines and output lines start with the number of their command, like `[3] `.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! CmdRunner runner;
+        //! runner.output(OutputMode::Lines, true);
+        //! runner.push(Cmd({"echo", "one"}));
+        //! runner.push(Cmd({"echo", "two"}));
+        //! runner.run();
+        //! ```
+        void output(OutputMode mode, bool prefix = false);
+
+        //! Stops starting new commands after `failures` commands have failed, like `ninja -k`.
+        //! Running commands are still awaited. Zero, the default, runs every command regardless.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! CmdRunner runner;
+        //! runner.keep_going(1); // Fail fast
+        //! runner.push(Cmd({"false"}));
+        //! runner.push(Cmd({"echo", "never started"}));
+        //! if (!runner.run()) runner.print_failed();
+        //! ```
+        void keep_going(size_t failures);
     };
     //! \example parallel-cmds/bob.cpp
 
     //! A list of file paths.
     typedef std::vector<fs::path> Paths;
 
+    //! File system information about a single file.
+    struct FileStat {
+        //! Whether the file exists.
+        bool exists = false;
+        //! Modification time in nanoseconds since the epoch.
+        int64_t mtime = 0;
+        //! Size of the file in bytes.
+        uintmax_t size = 0;
+    };
+
+    //! Reads the file system information of a file with a single `stat` call.
+    FileStat stat_file(const path &file);
+
+    //! \brief A thread safe cache of file system information.
+    //!
+    //! Recipes look up files through the global cache returned by `stat_cache()`,
+    //! so every file is only stat'ed once. Outputs are invalidated when a recipe builds them.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! FileStat main_stat = stat_cache().get("main.cpp");
+    //! if (main_stat.exists) std::cout << "main.cpp is " << main_stat.size << " bytes\n";
+    //! stat_cache().invalidate("main.cpp"); // Stat again on next lookup
+    //! ```
+    class StatCache {
+        std::mutex mutex;
+        std::unordered_map<string, FileStat> entries;
+    public:
+        //! Returns the cached information for a file, stat'ing it on a cache miss.
+        FileStat get(const path &file);
+        //! Stores already known information for a file.
+        void put(const path &file, const FileStat &stat);
+        //! Removes a file from the cache so it is stat'ed again on the next lookup.
+        void invalidate(const path &file);
+        //! Removes all files from the cache.
+        void clear();
+    };
+
+    //! Returns the global stat cache used by recipes.
+    StatCache &stat_cache();
+
+    //! A file found by `scan()`, together with the information read while scanning.
+    struct ScanEntry {
+        //! Path of the file, relative to the working directory if the scanned root was.
+        path file;
+        //! File system information of the file.
+        FileStat stat;
+    };
+
+    //! Options for `scan()`.
+    struct ScanOptions {
+        //! Patterns the paths relative to the root have to match. Empty matches all files.
+        vector<string> patterns = {};
+        //! Additional patterns to skip, in `.gitignore` syntax.
+        vector<string> ignore = {};
+        //! Skip files ignored by the `.gitignore` files found while scanning. `.git` is always skipped.
+        bool gitignore = true;
+        //! Number of threads scanning directories. Zero uses one per processor thread.
+        size_t threads = 0;
+    };
+
+    //! \brief Lists the files below `root` by walking its directories in parallel.
+    //!
+    //! Every entry is also stored in `stat_cache()`, so recipes using the found files
+    //! as inputs do not stat them again. The entries are sorted by path.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! ScanOptions options;
+    //! options.patterns = {"**/*.c", "**/*.cpp"};
+    //! options.ignore   = {"build/"};
+    //! for (const ScanEntry &entry : scan("src", options)) {
+    //!     std::cout << entry.file << ": " << entry.stat.size << " bytes\n";
+    //! }
+    //! ```
+    vector<ScanEntry> scan(const path &root, const ScanOptions &options = ScanOptions());
+
+    //! \brief Returns the files below `root` matching `pattern`, sorted by path.
+    //!
+    //! `*` and `?` match within a path component, `[...]` matches a set of characters
+    //! and `**` matches any number of directories. Only the directories below the
+    //! fixed leading components of the pattern are scanned, honouring `.gitignore` files,
+    //! and without `**` no deeper than the pattern reaches.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! Paths sources = glob("src/**/*.c");
+    //! ```
+    Paths glob(const string &pattern, const path &root = ".");
+
+    //! Checks if a relative path matches a `glob()` pattern.
+    bool glob_match(const string &pattern, const path &file);
+
+    //! Hashes a string with the 64-bit FNV-1a hash.
+    uint64_t hash_string(std::string_view data, uint64_t hash = 0xcbf29ce484222325ULL);
+
+    //! Hashes the content of a file. Returns 0 if the file cannot be read.
+    uint64_t hash_file(const path &file);
+
+    //! \brief An on-disk database of file content hashes and recipe signatures.
+    //!
+    //! When enabled with `use_build_db()`, recipes are only rebuilt when the content of
+    //! their inputs and outputs or their command actually changed. Modification times are
+    //! still used as a cheap first check, so unchanged files are never read twice.
+    //! The database also remembers how long commands and recipes took, so `CmdRunner` and
+    //! `Graph` can start the longest jobs first.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! use_build_db(); // Stored in `.bob/db`
+    //! Recipe({"main"}, {"main.c"}, Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"})).build();
+    //! ```
+    class BuildDb {
+        //! A file hash together with the stats it was computed for.
+        struct FileEntry {
+            int64_t   mtime;
+            uintmax_t size;
+            uint64_t  hash;
+        };
+        //! A recorded build of a set of outputs.
+        struct Signature {
+            uint64_t command;
+            uint64_t content;
+        };
+        std::mutex mutex;
+        std::unordered_map<string, FileEntry> files;
+        std::unordered_map<string, Signature> signatures;
+        std::unordered_map<string, Paths> deps;
+        std::unordered_map<string, int64_t> durations;
+        bool dirty = false;
+    public:
+        //! The file the database is stored in.
+        path file;
+
+        //! Opens the database stored in `file`. The file is created when the database is saved.
+        BuildDb(path file);
+        //! Saves the database.
+        ~BuildDb();
+        //! Loads the database from disk, replacing its content.
+        void load();
+        //! Writes the database to disk if it has changed.
+        void save();
+        //! Returns the content hash of a file. The file is only read if its size or modification time changed.
+        uint64_t hash(const path &file);
+        //! Looks up the command and content hashes recorded for `key`.
+        bool get_signature(const string &key, uint64_t *command, uint64_t *content);
+        //! Records the command and content hashes for `key`.
+        void set_signature(const string &key, uint64_t command, uint64_t content);
+        //! Looks up the discovered dependencies (e.g. included headers) of an output.
+        bool get_deps(const path &output, Paths *result);
+        //! Records the discovered dependencies (e.g. included headers) of an output.
+        void set_deps(const path &output, const Paths &dependencies);
+        //! Looks up how many milliseconds the job identified by `key` took the last time it ran.
+        bool get_duration(const string &key, int64_t *ms);
+        //! Records how many milliseconds the job identified by `key` took.
+        void set_duration(const string &key, int64_t ms);
+    };
+
+    //! Enables the global build database stored in `dir / "db"` and returns it.
+    BuildDb &use_build_db(path dir = ".bob");
+
+    //! Returns the global build database, or `nullptr` if it is not enabled.
+    BuildDb *build_db();
+    //! \example build-db/bob.cpp
+
+    //! \brief Parses a Makefile style depfile as written by `gcc -MMD` or `clang -MD`.
+    //!
+    //! @param depfile The depfile to read.
+    //! @return The dependencies of all rules in the depfile. Empty if the depfile does not exist.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! Paths headers = parse_depfile("build/main.d");
+    //! ```
+    Paths parse_depfile(const path &depfile);
+
+    //! \brief Parses the included files from compiler output produced by MSVC's `/showIncludes`.
+    //!
+    //! @param output The captured output of the compiler.
+    //! @return The files listed on `Note: including file:` lines.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! Cmd compile({"cl", "/showIncludes", "/c", "main.c"});
+    //! compile.run();
+    //! record_deps("main.obj", parse_show_includes(compile.output_str));
+    //! ```
+    Paths parse_show_includes(const string &output);
+
+    //! Records the discovered dependencies of an output in the build database, so later dirty checks
+    //! of recipes producing `output` also cover them. Does nothing if the build database is not enabled.
+    void record_deps(const path &output, const Paths &dependencies);
+
+    //! Returns the depfile path a compiler writes for an object file with `-MMD`, e.g. `build/main.d` for `build/main.o`.
+    path depfile_path(const path &output);
+
+    //! \brief A content addressed cache of recipe outputs, which can be shared between builds and machines.
+    //!
+    //! When enabled with `use_artifact_cache()`, recipes built from a command template look up their
+    //! outputs in the cache before running the command. The key is a hash of the rendered command, its
+    //! `root`, the tool binary, the content of the inputs (including depfile dependencies) and the output paths.
+    //! Artifacts are stored in a local directory and optionally in a remote HTTP cache,
+    //! which is accessed with `curl` using GET and PUT requests.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! use_artifact_cache(".bob/cache", "https://cache.example.com/bob");
+    //! Recipe({"main.o"}, {"main.c"}, Cmd({"gcc", "-c", "_INPUTS_", "-o", "_OUTPUTS_"})).build();
+    //! ```
+    class ArtifactCache {
+        std::mutex mutex;
+        std::unordered_map<string, uint64_t> tool_hashes;
+        //! Downloads a file from the remote cache. Returns `true` on success.
+        bool download(const string &name, const path &target);
+        //! Uploads a file to the remote cache.
+        void upload(const path &source, const string &name);
+    public:
+        //! Local directory where artifacts are stored.
+        path dir;
+        //! Base URL of the remote cache, or empty to only use the local directory.
+        string remote;
+
+        //! Create an artifact cache in `dir`, optionally backed by a remote cache at `remote`.
+        ArtifactCache(path dir, string remote = "");
+        //! Returns the content hash of the binary that runs `tool`, which is looked up in $PATH if needed.
+        uint64_t tool_hash(const string &tool);
+        //! Reads the dependency list stored for `key`. Returns `false` if there is none.
+        bool get_manifest(const string &key, Paths *deps);
+        //! Stores the dependency list for `key`. Returns `false` if it could not be written.
+        bool put_manifest(const string &key, const Paths &deps);
+        //! Copies the artifacts stored under `key` to `files`. Returns `false` on a cache miss,
+        //! which includes artifacts that could not be read or copied.
+        bool restore(const string &key, const Paths &files);
+        //! Stores `files` under `key`. Nothing is stored if any of them cannot be copied.
+        void store(const string &key, const Paths &files);
+    };
+
+    //! Enables the global artifact cache and returns it.
+    ArtifactCache &use_artifact_cache(path dir = ".bob/cache", string remote = "");
+
+    //! Returns the global artifact cache, or `nullptr` if it is not enabled.
+    ArtifactCache *artifact_cache();
+
     //! A function that can be used in a `Recipe` to build outputs from inputs.
     typedef std::function<void(const vector<path>&, const vector<path>&)> RecipeFunc;
 
@@ -514,38 +1517,389 @@ namespace bob {
         Paths outputs;
         //! The function that will be called to build the outputs from the inputs.
         RecipeFunc func;
+        //! If true, `inputs[i]` is built into `outputs[i]` and `func` is only called with the stale pairs.
+        bool mapped = false;
+        //! If true, the compiler depfile of each output (see `depfile_path()`) is read after building,
+        //! and the dependencies it lists are checked together with the inputs. Compile with `-MMD` to produce it.
+        bool depfiles = false;
+
+        //! Command template used to build the outputs. Empty if the recipe is built by a custom function.
+        Cmd cmd;
 
         //! Constructs a recipe with the given outputs, inputs, and build function.
         Recipe(const Paths &outputs, const Paths &inputs, RecipeFunc func);
+        //! \brief Constructs a recipe which builds its outputs by running a command.
+        //!
+        //! The special parts `_INPUTS_` and `_OUTPUTS_` are replaced with the inputs and outputs
+        //! of the recipe. With a build database, changing the command forces a rebuild.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! Recipe app({"app"}, {"main.c", "util.c"}, Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"}));
+        //! app.build(); // Runs: gcc -o app main.c util.c
+        //! ```
+        Recipe(const Paths &outputs, const Paths &inputs, const Cmd &cmd);
+        //! \brief Constructs a mapped recipe where every input is built into the output at the same index.
+        //!
+        //! Only the input/output pairs that are out of date are passed to `func`.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! auto objs = Recipe::map({"main.o", "other.o"}, {"main.c", "other.c"},
+        //!     [](const Paths &inputs, const Paths &outputs) {
+        //!         CmdRunner runner;
+        //!         for (size_t i = 0; i < inputs.size(); ++i) {
+        //!             runner.push(Cmd({"gcc", "-c", inputs[i], "-o", outputs[i]}));
+        //!         }
+        //!         runner.run();
+        //! });
+        //! objs.build(); // Only compiles the files that changed
+        //! ```
+        static Recipe map(const Paths &outputs, const Paths &inputs, RecipeFunc func);
+        //! Constructs a mapped recipe which runs `cmd` for every stale input/output pair in parallel.
+        //! `_INPUTS_` and `_OUTPUTS_` are replaced with the input and output of the pair.
+        static Recipe map(const Paths &outputs, const Paths &inputs, const Cmd &cmd);
+        //! Renders the command template for the given inputs and outputs.
+        Cmd command(const Paths &inputs, const Paths &outputs) const;
+        //! Returns the inputs together with their discovered dependencies, e.g. headers listed in depfiles.
+        Paths all_dependencies() const;
+        //! Returns the indices of the outputs that need to be rebuilt. For a recipe which is not
+        //! mapped, this is either all or none of the outputs.
+        vector<size_t> stale() const;
         //! Use the modified time of the inputs and outputs to determine if the recipe needs to be rebuilt.
+        //! With a build database, content hashes decide for inputs whose modified time changed.
         bool needs_rebuild() const;
         //! Builds the outputs from the inputs using the recipe function.
         void build() const;
+        //! \brief Prepares building the recipe by a command the caller runs, e.g. next to other commands.
+        //!
+        //! Returns `false` if nothing needs to run: the recipe is up to date, its outputs were restored
+        //! from the artifact cache, or it is mapped or built by a function and was built by `build()`.
+        //! Otherwise `cmd` is set to the rendered command template, and `finish()` must be called once
+        //! it succeeded.
+        bool prepare_cmd(Cmd &cmd) const;
+        //! Records a successful run of the command from `prepare_cmd()`, which took `duration_ms`
+        //! milliseconds if known. Exits if the outputs are missing.
+        void finish(int64_t duration_ms = -1) const;
+
+    private:
+        //! Checks if `outputs` need to be rebuilt from `inputs`.
+        bool is_stale(const Paths &inputs, const Paths &outputs) const;
+        //! Hashes the command which builds `outputs` from `inputs`.
+        uint64_t command_hash(const Paths &inputs, const Paths &outputs) const;
+        //! Hashes the content of `inputs` and `outputs`.
+        uint64_t content_hash(BuildDb &db, const Paths &inputs, const Paths &outputs) const;
+        //! Records a successful build of `outputs` from `inputs` in the build database.
+        void record(const Paths &inputs, const Paths &outputs) const;
+        //! Returns `inputs` together with the discovered dependencies of `outputs`.
+        Paths dependencies(const Paths &inputs, const Paths &outputs) const;
+        //! Hashes everything that identifies the artifacts except the dependencies from depfiles.
+        uint64_t cache_base_hash(ArtifactCache &cache, const Paths &inputs, const Paths &outputs) const;
+        //! Computes the artifact cache key for building `outputs` from `inputs`.
+        //! Returns `false` if the dependencies needed for the key are unknown.
+        bool cache_key(ArtifactCache &cache, const Paths &inputs, const Paths &outputs, string *key) const;
+        //! Files stored in the artifact cache for `outputs`.
+        Paths artifacts(const Paths &outputs) const;
+        //! Restores `outputs` from the artifact cache. Returns `false` on a cache miss.
+        bool restore_cached(const Paths &inputs, const Paths &outputs) const;
+        //! Stores freshly built `outputs` in the artifact cache.
+        void store_cached(const Paths &inputs, const Paths &outputs) const;
+        //! Checks the outputs after building the stale pairs and records the build of all pairs.
+        void finish_build(const Paths &stale_inputs, const Paths &stale_outputs, Paths done_inputs, Paths done_outputs) const;
     };
     //! \example recipe/bob.cpp
 
-    //! Types of command line flags.
-    enum class CliFlagType {
-        //! Boolean flag, e.g. `-v` or `--verbose`.
-        Bool,
-        //! Option with a value, e.g. `-o file.txt` or `--output file.txt`.
-        Value
+    //! \brief Watches files for changes, using inotify with a polling fallback.
+    //!
+    //! The directories containing the files are watched, so files replaced by editors
+    //! (written to a temporary file and renamed) are still noticed. Changed files are
+    //! invalidated in the stat cache.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! FileWatcher watcher;
+    //! watcher.add("main.c");
+    //! for (const path &file : watcher.wait()) {
+    //!     std::cout << file << " changed" << std::endl;
+    //! }
+    //! ```
+    class FileWatcher {
+        //! inotify file descriptor, or -1 when polling.
+        int inotify_fd = -1;
+        //! Watched directories by watch descriptor.
+        std::unordered_map<int, path> dirs;
+        //! Last known stats of the watched files, used when polling.
+        std::unordered_map<string, FileStat> files;
+        //! Reads pending inotify events and collects the watched files they affect.
+        void read_events(Paths &changed);
+        //! Compares the watched files with their last known stats.
+        void poll_files(Paths &changed);
+    public:
+        //! Create a watcher. Falls back to polling if inotify is not available.
+        FileWatcher();
+        ~FileWatcher();
+        FileWatcher(const FileWatcher &) = delete;
+        FileWatcher &operator=(const FileWatcher &) = delete;
+        //! Starts watching `file`.
+        void add(const path &file);
+        //! Stops watching all files.
+        void clear();
+        //! Returns `true` if inotify is used instead of polling.
+        bool native() const;
+        //! Blocks until watched files change and returns them. Changes in quick succession
+        //! are returned together. Returns an empty list if `timeout_ms` passes first.
+        Paths wait(int timeout_ms = -1);
     };
 
-    //! Represents a command flag argument
-    struct CliFlag {
-
-        //! The short name of the flag, e.g. `-v`.
-        char    short_name  = '\0';
-        //! The long name of the flag, e.g. `--verbose`.
-        string  long_name   = "";
-        //! Description of the flag, e.g. "Enable verbose output".
-        string  description = "";
-        //! Whether the flag is set or not.
-        bool    set         = false;
-        //! The value of the flag if it is an option with a value, e.g. `file.txt` for `--output file.txt`.
-        //!
-        //! Only used for options with values.
+    //! \brief A dependency graph of recipes which are built in parallel.
+    //!
+    //! Edges between recipes are inferred by matching the outputs of one recipe with
+    //! the inputs of another. Recipes are built in topological order, and recipes that
+    //! do not depend on each other are built concurrently on up to `jobs` threads.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! Graph graph;
+    //! graph.add(Recipe({"main"}, {"main.o"}, [](const Paths &inputs, const Paths &outputs) {
+    //!     Cmd({"gcc", "-o", outputs[0], inputs[0]}).check();
+    //! }));
+    //! graph.add(Recipe({"main.o"}, {"main.c"}, [](const Paths &inputs, const Paths &outputs) {
+    //!     Cmd({"gcc", "-c", inputs[0], "-o", outputs[0]}).check();
+    //! }));
+    //! graph.build(); // Builds `main.o` before `main`
+    //! ```
+    class Graph {
+        //! For each recipe, the indices of the recipes producing its inputs.
+        vector<vector<size_t>> deps;
+        //! Infer the edges of the graph from the inputs and outputs of the recipes.
+        void infer_edges();
+        //! Returns for each recipe the expected time from starting it until the end of the build.
+        vector<int64_t> critical_path(const vector<vector<size_t>> &dependents);
+        //! Builds the selected recipes in dependency order.
+        void build_selected(const vector<bool> &selected);
+    public:
+        //! The recipes in the graph.
+        vector<Recipe> recipes;
+        //! The maximum number of recipes to build concurrently.
+        size_t jobs;
+
+        //! Create an empty graph which builds as many recipes concurrently as there are processor threads.
+        Graph();
+        //! Create an empty graph which builds at most `jobs` recipes concurrently.
+        Graph(size_t jobs);
+        //! Adds a recipe to the graph. Returns a reference to the graph (for chaining).
+        Graph& add(Recipe recipe);
+        //! Returns the indices of the recipes in an order where every recipe comes after its dependencies.
+        //! Panics if the graph contains a cycle.
+        vector<size_t> order();
+        //! Builds all recipes in the graph that need rebuilding.
+        //!
+        //! Ready recipes on the longest path to the end of the build are started first. The length of
+        //! a path is the sum of the recipe durations from earlier runs in the build database,
+        //! or the number of recipes on it if the database is not enabled.
+        //!
+        //! If a recipe fails, no new recipes are started, and the build exits with its error once
+        //! the running ones are done. Other exceptions thrown by recipe functions are rethrown.
+        void build();
+        //! \brief Builds the graph, then rebuilds it whenever an input changes. Never returns.
+        //!
+        //! The graph and the stat cache stay in memory, and only recipes affected by a change
+        //! (and the recipes depending on them) are checked again. Discovered dependencies, like
+        //! headers from depfiles, are watched as well. Failing recipes and exceptions thrown by recipe
+        //! functions are printed instead of ending the watch, and the recipes left unbuilt are built
+        //! again together with the next change.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! Graph graph;
+        //! graph.add(Recipe({"main"}, {"main.c"}, Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"})));
+        //! graph.watch([]() { std::cout << "Up to date, waiting for changes..." << std::endl; });
+        //! ```
+        [[noreturn]] void watch(std::function<void()> on_built = nullptr);
+        //! \brief Writes a ninja build file which builds the recipes of the graph.
+        //!
+        //! Every recipe made from a command template becomes a build statement running the rendered
+        //! command, one per input/output pair for mapped recipes. Recipes with `depfiles` let ninja read
+        //! the depfile of each output. Recipes built by a function or a task cannot be expressed in ninja
+        //! and are skipped with a warning. Paths stay relative to the working directory, so ninja must run there.
+        //!
+        //! If `regenerate` is given, ninja reruns it to write the file again when one of `sources`
+        //! (and `bob.hpp`) changes, like CMake does. Since `GO_REBUILD_YOURSELF` rebuilds bob when
+        //! its source is newer, the command is usually bob itself. The file is only written when its
+        //! content changes, so ninja does not reload an identical manifest.
+        //!
+        //! @return `true` if the file was written.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! Graph graph;
+        //! graph.add(Recipe::map({"main.o"}, {"main.c"}, Cmd({"gcc", "-MMD", "-c", "_INPUTS_", "-o", "_OUTPUTS_"})));
+        //! graph.add(Recipe({"main"}, {"main.o"}, Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"})));
+        //! graph.write_ninja("build.ninja", Cmd({"./bob", "ninja"}));
+        //! ```
+        bool write_ninja(const path &file = "build.ninja", const Cmd &regenerate = Cmd(), const Paths &sources = {"bob.cpp"});
+        //! \brief Writes a `compile_commands.json` for clangd and other tools.
+        //!
+        //! Every C, C++ or Objective-C input of a recipe made from a command template gets an entry
+        //! with the rendered command which compiles it. The file is only written when its content changes.
+        //!
+        //! @return `true` if the file was written.
+        //!
+        //! @par Example
+        //! ```cpp
+        //! Graph graph;
+        //! graph.add(Recipe::map({"main.o", "util.o"}, {"main.c", "util.c"}, Cmd({"gcc", "-c", "_INPUTS_", "-o", "_OUTPUTS_"})));
+        //! graph.write_compile_commands();
+        //! ```
+        bool write_compile_commands(const path &file = "compile_commands.json");
+    };
+
+    //! \brief Compiles many small source files as a few unity (jumbo) translation units.
+    //!
+    //! The sources are split into `groups` wrapper files in `dir`, each including its share of the
+    //! sources, which are balanced by their compile times in the build database or else by their size.
+    //! The grouping is stored in the wrappers themselves and kept as long as the sources stay the same,
+    //! so wrappers are only rewritten (and recompiled) when files are added or removed.
+    //!
+    //! A source edited on its own is split off from its unit and compiled by itself from then on, so
+    //! further edits only recompile that file. Split off files rejoin their units on a clean build.
+    //! With the build database (see `use_build_db()`) only changes to the content count as edits.
+    //!
+    //! The units are compiled by a mapped recipe running `cmd`, which reads the depfiles of the units
+    //! so the edits to included sources and headers are noticed. `cmd` must write them with `-MMD`.
+    //! Like any unity build, sources must not define conflicting `static` names or macros.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! UnityBuild unity(glob("src/*.cpp"), "build/unity", Cmd({"g++", "-MMD", "-c", "_INPUTS_", "-o", "_OUTPUTS_"}), 4);
+    //! Recipe objects = unity.recipe();
+    //! Graph graph;
+    //! graph.add(objects);
+    //! graph.add(Recipe({"app"}, objects.outputs, Cmd({"g++", "-o", "_OUTPUTS_", "_INPUTS_"})));
+    //! graph.build();
+    //! ```
+    class UnityBuild {
+        //! Reads the sources included by each existing wrapper.
+        vector<Paths> read_groups() const;
+        //! Balances the sources over `count` groups, keeping the sources of `previous` where they are.
+        vector<Paths> balance(const Paths &grouped, const vector<Paths> &previous, size_t count) const;
+    public:
+        //! The source files to compile.
+        Paths sources;
+        //! Directory for the wrapper files and objects.
+        path dir;
+        //! Command template compiling `_INPUTS_` into `_OUTPUTS_`.
+        Cmd cmd;
+        //! Number of unity translation units.
+        size_t groups;
+
+        //! Create a unity build of `sources` in `dir`, with one unit per processor thread when `groups` is 0.
+        UnityBuild(const Paths &sources, path dir, const Cmd &cmd, size_t groups = 0);
+
+        //! Groups the sources, writes the wrappers whose content changed and returns a mapped recipe
+        //! which compiles the wrappers and the split off sources into their objects.
+        Recipe recipe();
+    };
+    //! \example unity/bob.cpp
+
+    //! \brief Runs record/replay tests of many test cases in parallel.
+    //!
+    //! A test case is a directory with a `test.list` of shell commands, one per line, and a
+    //! `test.list.bi` with the exit code, stdout and stderr recorded for each of them, in the format
+    //! of rere.py. The tests of a case run in order, since later ones use what earlier ones built, but
+    //! every test is a job of its own: free slots take the next test of any case, longest cases first.
+    //! A case starts its tests as soon as it is set up, while other cases are still being built.
+    //!
+    //! Before its tests, a case runs its `prepare` commands and builds its `build` recipes that are
+    //! stale, so test binaries are only compiled again when their sources change. Like rere.py,
+    //! a case stops at its first failing test. Like a `CmdRunner`, it shares the job slots of the
+    //! jobserver it runs under (see `jobserver()`), and counts its jobs in the status line.
+    //!
+    //! @par Example
+    //! ```cpp
+    //! TestRunner tests;
+    //! tests.timeout_ms = 60 * 1000;
+    //! for (const path &list : glob("*/test.list", "examples")) {
+    //!     path dir = list.parent_path();
+    //!     tests.add(dir, {}, {Recipe({dir / "bob"}, {dir / "bob.cpp"}, Cmd({"g++", "bob.cpp", "-o", "bob"}, dir))});
+    //! }
+    //! if (!tests.replay()) tests.print_failed();
+    //! tests.print_timings(5);
+    //! ```
+    class TestRunner {
+    public:
+        //! The outcome of a single test, or of a setup step of a test case.
+        struct Result {
+            //! Directory of the test case.
+            path dir;
+            //! The shell command of the test, or the rendered setup command.
+            string shell;
+            //! Whether the test matched its recording, or the setup command succeeded.
+            bool passed;
+            //! Run time in milliseconds.
+            double ms;
+            //! What did not match, or the output of a failed setup command.
+            string message;
+        };
+
+        //! The number of jobs to run concurrently.
+        size_t process_count;
+        //! Kills a test running longer than this many milliseconds, or 0 for no limit.
+        int64_t timeout_ms = 0;
+        //! Results in the order the jobs finished.
+        vector<Result> results;
+
+        //! Create a test runner with one slot per processor thread when `process_count` is 0.
+        TestRunner(size_t process_count = 0);
+
+        //! Adds the test case in `dir`, which runs `prepare` and builds the stale `build` recipes before its tests.
+        void add(const path &dir, vector<Cmd> prepare = {}, vector<Recipe> build = {});
+
+        //! Runs the tests and compares them with their recordings. Returns `true` if all of them match.
+        bool replay();
+
+        //! Runs the tests and records their results in `test.list.bi`. Returns `true` if the setup of every case succeeded.
+        bool record();
+
+        //! Prints the failed tests and setup commands with what went wrong.
+        void print_failed() const;
+
+        //! Prints the `count` slowest tests and the total time of every test case.
+        void print_timings(size_t count = 10) const;
+
+    private:
+        struct TestCase {
+            path dir;
+            vector<Cmd> prepare;
+            vector<Recipe> build;
+        };
+        vector<TestCase> cases;
+        //! Runs every case, comparing with or recording the results.
+        bool run(bool recording);
+    };
+
+    //! Types of command line flags.
+    enum class CliFlagType {
+        //! Boolean flag, e.g. `-v` or `--verbose`.
+        Bool,
+        //! Option with a value, e.g. `-o file.txt` or `--output file.txt`.
+        Value
+    };
+
+    //! Represents a command flag argument
+    struct CliFlag {
+
+        //! The short name of the flag, e.g. `-v`.
+        char    short_name  = '\0';
+        //! The long name of the flag, e.g. `--verbose`.
+        string  long_name   = "";
+        //! Description of the flag, e.g. "Enable verbose output".
+        string  description = "";
+        //! Whether the flag is set or not.
+        bool    set         = false;
+        //! The value of the flag if it is an option with a value, e.g. `file.txt` for `--output file.txt`.
+        //!
+        //! Only used for options with values.
         string  value       = "";
         //! The type of the flag..
         CliFlagType type;
@@ -653,12 +2007,17 @@ namespace bob {
     //! A command line interface (CLI) that can be used to run commands and subcommands.
     class Cli : public CliCommand {
         vector<string> raw_args;
+        //! True if `--trace` is handled by `serve()`.
+        bool trace_flag = false;
         void set_defaults(int argc, char* argv[]);
     public:
         //! Create a new CLI interface.
         Cli(int argc, char* argv[]);
         //! Create a new CLI interface with a title.
         Cli(string title, int argc, char* argv[]);
+        //! Adds the `--trace <file>` flag, also written as `--trace=<file>`, to every command.
+        //! It writes a Chrome trace of the build to the file, see `Tracer`.
+        Cli &add_trace_flag();
         //! Run the CLI and handle the commands.
         int serve();
     };
@@ -749,7 +2108,8 @@ namespace bob {
 
 #endif // BOB_H_
 
-#ifdef BOB_IMPLEMENTATION
+// With `BOB_EXTERNAL_IMPLEMENTATION`, the implementation is linked from a separately compiled object
+#if defined(BOB_IMPLEMENTATION) && !defined(BOB_EXTERNAL_IMPLEMENTATION)
 //! \cond DO_NOT_DOCUMENT
 
 namespace bob {
@@ -761,6 +2121,17 @@ namespace bob {
         auto run_cmd = Cmd({"./" + bin_path.string()});
         for (int i = 1; i < argc; ++i) run_cmd.push(argv[i]);
         std::cout << std::endl;
+
+        // Replace this process, so the new executable keeps the terminal and nothing is relayed
+        std::cout << "CMD: " << run_cmd.render() << std::endl;
+        std::cerr.flush();
+        vector<char *> args;
+        for (const auto &part : run_cmd.get_parts()) args.push_back(const_cast<char *>(part.c_str()));
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+
+        WARNING("Could not exec " + bin_path.string() + ": " + strerror(errno) + ". Running it as a child process instead.");
+        run_cmd.echo = false;
         return run_cmd.run();
     }
 
@@ -788,14 +2159,81 @@ namespace bob {
         return cmd;
     }
 
+    //! Reads a whole file. Returns an empty string if it cannot be read.
+    string read_file(const path &file) {
+        std::ifstream in(file, std::ios::binary);
+        std::ostringstream oss;
+        oss << in.rdbuf();
+        return oss.str();
+    }
+
+    void RebuildConfig::build(string source, string program) const {
+        if (object.empty()) {
+            cmd(source, program).check();
+            return;
+        }
+
+        // A small translation unit holding only the implementation
+        path implementation = object;
+        implementation.replace_extension(".cpp");
+        string content = "#define BOB_IMPLEMENTATION\n#include \"" + fs::absolute(__FILE__).string() + "\"\n";
+        if (read_file(implementation) != content) {
+            if (object.has_parent_path()) fs::create_directories(object.parent_path());
+            std::ofstream(implementation) << content;
+        }
+
+        // Compile with the same flags, leaving out the ones only meant for the linker and other
+        // source or object files, which are only passed when linking
+        const std::unordered_set<string> with_value = {"-o", "-I", "-D", "-U", "-include", "-isystem", "-iquote", "-x", "-L", "-l", "-Xlinker"};
+        Cmd compile;
+        for (size_t i = 0; i < parts.size(); i++) {
+            const string &part = parts[i];
+            const string &option = i > 0 ? parts[i - 1] : "";
+            bool value = with_value.count(option) > 0;
+            bool linker = part.rfind("-l", 0) == 0 || part.rfind("-L", 0) == 0 || part.rfind("-Wl,", 0) == 0 || part == "-Xlinker";
+            if (linker || (value && (option == "-l" || option == "-L" || option == "-Xlinker"))) continue;
+            if (i > 0 && !value && part[0] != '-' && part != PROGRAM && part != SOURCE) continue;
+            if      (part == PROGRAM) compile.push(object.string());
+            else if (part == SOURCE)  compile.push(implementation.string());
+            else                      compile.push(part);
+        }
+        compile.push("-c");
+
+        // The command is remembered, so changing compiler flags also recompiles the object
+        path stamp = object;
+        stamp += ".cmd";
+        FileStat object_stat = stat_file(object);
+        bool stale = !object_stat.exists
+            || object_stat.mtime < stat_file(__FILE__).mtime
+            || object_stat.mtime < stat_file(implementation).mtime
+            || read_file(stamp) != compile.render();
+        if (stale) {
+            compile.check();
+            std::ofstream(stamp) << compile.render();
+        }
+
+        Cmd link = cmd(source, program);
+        link.push("-DBOB_EXTERNAL_IMPLEMENTATION");
+        link.push(object.string());
+        link.check();
+    }
+
     void go_rebuild_yourself(int argc, char* argv[], path source_file_name, RebuildConfig config) {
         assert(argc > 0 && "No program provided via argv[0]");
 
+        path header_path = __FILE__;
+
+        // Starting without a rebuild only costs a few stat calls
+        FileStat binary = stat_file(argv[0]);
+        FileStat source = stat_file(source_file_name);
+        FileStat header = stat_file(header_path);
+        if (binary.exists && source.exists && header.exists
+            && source.mtime <= binary.mtime && header.mtime <= binary.mtime) return;
+
         path root = fs::current_path();
 
         path binary_path = fs::relative(argv[0], root);
         path source_path = fs::relative(source_file_name, root);
-        path header_path = __FILE__;
 
         if (source_path.has_parent_path()) {
             WARNING("Source file is not next to executable. This may cause issues.");
@@ -806,13 +2244,11 @@ namespace bob {
                   "The bob executable must be compiled and run from the same directory as the source file.");
         }
 
-        bool rebuild_needed = false;
-
         auto rebuild_yourself = Recipe(
                 {binary_path},
                 {source_path, header_path},
                 [binary_path, source_path, config](Paths, Paths) {
-                    config.cmd(source_path.string(), binary_path.string()).check();
+                    config.build(source_path.string(), binary_path.string());
                 }
         );
 
@@ -855,34 +2291,102 @@ namespace bob {
         std::cerr << term::YELLOW << "[WARNING] " << file.string() << ":" << line << ": " << msg << term::RESET << std::endl;
     }
 
+    // Nonzero while the current thread builds a recipe, so failures throw `BuildError` instead of exiting
+    thread_local int build_error_scopes = 0;
+
+    struct BuildErrorScope {
+        BuildErrorScope()  { build_error_scopes++; }
+        ~BuildErrorScope() { build_error_scopes--; }
+    };
+
     [[noreturn]]
     void _panic(path file, int line, string msg) {
+        if (build_error_scopes > 0) throw BuildError(msg);
         std::cerr << term::RED << "[ERROR] " << file.string() << ":" << line << ": " << msg << term::RESET << std::endl;
         exit(1);
     }
 
     string I(path p) { return "-I" + p.string(); }
 
+    // The directories of $PATH, each listed at most once, and the binaries already looked up.
+    // Everything is thrown away when $PATH changes.
+    struct PathCache {
+        std::mutex mutex;
+        string path_env;
+        bool parsed = false;
+        vector<path> dirs;
+        vector<std::unique_ptr<std::unordered_set<string>>> listings;
+        std::unordered_map<string, path> resolved;
+    };
+
+    std::unordered_set<string> list_dir(const path &dir) {
+        std::unordered_set<string> names;
+        DIR *handle = opendir(dir.c_str());
+        if (handle == nullptr) return names;
+        while (struct dirent *ent = readdir(handle)) names.insert(ent->d_name);
+        closedir(handle);
+        return names;
+    }
+
+    bool is_executable(const path &file) {
+        struct stat st;
+        return ::stat(file.c_str(), &st) == 0 && !S_ISDIR(st.st_mode) && access(file.c_str(), X_OK) == 0;
+    }
+
     // Check if a binary is in the system PATH
     path search_path(const string &bin_name) {
-        string path_env = getenv("PATH");
-        if (path_env.empty()) PANIC("PATH environment variable is not set.");
+        if (bin_name.find('/') != string::npos) return is_executable(bin_name) ? path(bin_name) : path();
+
+        static PathCache cache;
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        const char *path_env = getenv("PATH");
+        if (!cache.parsed || cache.path_env != (path_env ? path_env : "")) {
+            cache.path_env = path_env ? path_env : "";
+            cache.dirs.clear();
+            cache.listings.clear();
+            cache.resolved.clear();
+            cache.parsed = true;
+
+            // Directories are seperated by ':', an empty entry is the current directory
+            if (path_env) {
+                size_t start = 0;
+                while (true) {
+                    size_t end = cache.path_env.find(':', start);
+                    string dir = cache.path_env.substr(start, end == string::npos ? string::npos : end - start);
+                    cache.dirs.push_back(dir.empty() ? "." : dir);
+                    if (end == string::npos) break;
+                    start = end + 1;
+                }
+            }
+            cache.listings.resize(cache.dirs.size());
+        }
 
-        // Iterate through each directory in PATH seperated by ':'
-        size_t start = 0;
-        size_t end   = path_env.find(':');
+        auto it = cache.resolved.find(bin_name);
+        if (it != cache.resolved.end()) return it->second;
 
-        while (end != string::npos) {
-            string dir = path_env.substr(start, end - start);
-            path bin = fs::path(dir) / bin_name;
-            if (fs::exists(bin)) {
-                return bin;
+        path result;
+        for (size_t i = 0; i < cache.dirs.size(); i++) {
+            if (!cache.listings[i]) {
+                cache.listings[i] = std::make_unique<std::unordered_set<string>>(list_dir(cache.dirs[i]));
+            }
+            if (cache.listings[i]->count(bin_name) == 0) continue;
+            path bin = cache.dirs[i] / bin_name;
+            if (is_executable(bin)) {
+                result = bin;
+                break;
             }
-            start = end + 1;
-            end = path_env.find(':', start);
         }
+        cache.resolved[bin_name] = result;
+        return result;
+    }
 
-        return "";
+    // The file to execute for a command, so children do not search $PATH themselves.
+    // Binaries in relative $PATH directories are left to `execvp`, as the child may change directory.
+    string resolve_executable(const string &bin_name) {
+        if (bin_name.find('/') != string::npos) return bin_name;
+        path bin = search_path(bin_name);
+        return bin.is_absolute() ? bin.string() : bin_name;
     }
 
     void checklist(const vector<string> &items, const vector<bool> &statuses) {
@@ -928,232 +2432,1883 @@ namespace bob {
         exit(EXIT_FAILURE);
     }
 
-    bool read_fd(int fd, string * target) {
+    // Read everything currently available from a non-blocking file descriptor and pass it to `sink`
+    // in chunks. Sets `eof` when the writing end has been closed.
+    bool read_fd(int fd, const std::function<void(std::string_view)> &sink, bool * eof) {
+        static thread_local vector<char> buf(1 << 16);
         bool got_data = false;
         for (;;) {
-            char buf[1024];
-            int n = read(fd, buf, sizeof(buf) - 1);
-            if (n <= 0) return got_data;
-            got_data = true;
-            target->append(buf, n);
+            ssize_t n = read(fd, buf.data(), buf.size());
+            if (n > 0) {
+                got_data = true;
+                sink(std::string_view(buf.data(), n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || errno != EAGAIN) *eof = true; // A PTY master reports EIO when the child hangs up
+            return got_data;
         }
-        return got_data;
     }
 
+    // Open a pidfd for the process, or return -1 if the system does not support it.
+    int open_exit_fd(pid_t pid) {
+        #ifdef SYS_pidfd_open
+            return syscall(SYS_pidfd_open, pid, 0);
+        #else
+            return -1;
+        #endif
+    }
 
-    CmdFuture::CmdFuture() : cpid(-1), done(false), exit_code(-1) {}
-
-    int CmdFuture::await(string * output) {
-        while (!done) {
-            done = poll(output);
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // Process groups of the running commands, so they can all be killed when bob is interrupted.
+    // A fixed array of atomics, because the signal handler can neither lock nor allocate.
+    const size_t MAX_PROCESS_GROUPS = 4096;
+    std::atomic<pid_t> process_groups[MAX_PROCESS_GROUPS];
+    // Number of commands being spawned whose process group is not registered yet, and whether an
+    // interrupt handler is about to terminate bob
+    std::atomic<int> spawns_in_progress{0};
+    std::atomic<bool> terminating{false};
+    // The signal mask of the thread before `SpawnGuard` blocked the interrupts, which spawned commands get
+    thread_local sigset_t spawn_sigmask;
+
+    void kill_running_cmds() {
+        // A command which is being spawned is registered before the spawn is done
+        struct timespec delay = {0, 1000000};
+        while (spawns_in_progress.load() > 0) nanosleep(&delay, nullptr);
+        for (auto &group : process_groups) {
+            pid_t pgid = group.load();
+            if (pgid > 0) ::kill(-pgid, SIGKILL);
         }
-        return exit_code;
     }
 
-    bool CmdFuture::poll(string * output) {
-        if (done) return true;
+    void kill_process_groups(int sig) {
+        terminating = true;
+        kill_running_cmds();
+        // The handler was reset, so the signal terminates bob as usual once the handler returns
+        raise(sig);
+    }
 
-        string new_output = "";
-        bool got_data = read_fd(output_fd, &new_output);
-        if (got_data && !silent) {
-            std::cout << new_output;
-        }
+    // Kills the process groups of running commands on SIGINT, SIGTERM and SIGHUP, unless the
+    // program handles or ignores these signals itself. Commands do not get terminal signals
+    // themselves, as they do not run in the foreground process group.
+    void install_interrupt_handler() {
+        static std::once_flag once;
+        std::call_once(once, [] {
+            for (int sig : {SIGINT, SIGTERM, SIGHUP}) {
+                struct sigaction old;
+                if (sigaction(sig, nullptr, &old) < 0 || old.sa_handler != SIG_DFL) continue;
+                struct sigaction action = {};
+                action.sa_handler = kill_process_groups;
+                action.sa_flags = SA_RESETHAND | SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                sigaction(sig, &action, nullptr);
+            }
+        });
+    }
 
-        if (output && got_data) {
-            *output += new_output;
+    // Blocks the interrupts on this thread while a command is spawned and its process group is
+    // registered, so no interrupt handler runs in between and `kill_running_cmds()` waits for it instead.
+    struct SpawnGuard {
+        SpawnGuard() {
+            install_interrupt_handler();
+            sigset_t interrupts;
+            sigemptyset(&interrupts);
+            for (int sig : {SIGINT, SIGTERM, SIGHUP}) sigaddset(&interrupts, sig);
+            pthread_sigmask(SIG_BLOCK, &interrupts, &spawn_sigmask);
+            spawns_in_progress++;
+            // bob is being terminated, so nothing new may be spawned which outlives it
+            if (terminating.load()) {
+                spawns_in_progress--;
+                for (;;) pause();
+            }
         }
+        ~SpawnGuard() {
+            spawns_in_progress--;
+            pthread_sigmask(SIG_SETMASK, &spawn_sigmask, nullptr);
+        }
+    };
 
-        int status;
-        pid_t result = waitpid(cpid, &status, WNOHANG);
-
-        if (result == -1) PANIC("Error while polling child process: " + string(strerror(errno)));
-
-        if (result == 0) return false;
-
-        done = true;
-        if (WIFEXITED(status)) exit_code = WEXITSTATUS(status);
-        else PANIC("Child process did not terminate normally.");
-        return true;
+    void register_process_group(pid_t pgid) {
+        for (auto &group : process_groups) {
+            pid_t expected = 0;
+            if (group.compare_exchange_strong(expected, pgid)) return;
+        }
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true)) {
+            WARNING("More than " + std::to_string(MAX_PROCESS_GROUPS) + " commands are running, "
+                    "so some of them are not killed when bob is interrupted.");
+        }
     }
 
-    bool CmdFuture::kill() {
-        if (cpid < 0) return false;
-        if (::kill(cpid, SIGKILL) < 0) {
-            std::cerr << "Failed to kill child process: " << strerror(errno) << std::endl;
-            return false;
+    void unregister_process_group(pid_t pgid) {
+        for (auto &group : process_groups) {
+            pid_t expected = pgid;
+            if (group.compare_exchange_strong(expected, 0)) return;
         }
-        // Reset the state
-        cpid = -1;
-        done = true;
-        exit_code = -1;
+    }
 
-        return true;
+    string json_escape(const string &text) {
+        string result;
+        for (char c : text) {
+            switch (c) {
+                case '"':  result += "\\\""; break;
+                case '\\': result += "\\\\"; break;
+                case '\n': result += "\\n"; break;
+                case '\t': result += "\\t"; break;
+                default:
+                    if ((unsigned char) c < 0x20) {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        result += buf;
+                    } else {
+                        result += c;
+                    }
+            }
+        }
+        return result;
     }
 
-    Cmd::Cmd(vector<string> &&parts, path root) : parts(std::move(parts)), root(root) {}
+    Tracer::Tracer(path file) : epoch(std::chrono::steady_clock::now()), file(file) {
+        for (auto [pid, name] : {std::pair{COMMANDS, "commands"}, std::pair{RECIPES, "recipes"}}) {
+            events.push_back("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid)
+                             + ",\"args\":{\"name\":\"" + name + "\"}}");
+        }
+    }
 
-    Cmd& Cmd::push(const string &part) {
-        parts.push_back(part);
-        return *this;
+    Tracer::~Tracer() {
+        write();
     }
 
-    Cmd& Cmd::push_many(const vector<string> &parts) {
-        for (const auto &part : parts) {
-            this->parts.push_back(part);
-        }
-        return *this;
+    int64_t Tracer::now() const {
+        auto elapsed = std::chrono::steady_clock::now() - epoch;
+        return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
     }
 
-    string Cmd::render() const {
-        string result;
-        for (const auto &part : parts) {
-            if (!result.empty()) result += " ";
-            result += part;
-        }
-        if (root != ".") {
-            path rel_root = fs::relative(root, fs::current_path());
-            result = "[from '" + rel_root.string() + "'] " + result;
+    int Tracer::acquire_lane() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < lanes.size(); ++i) {
+            if (lanes[i]) continue;
+            lanes[i] = true;
+            return (int) i;
         }
-        return result;
+        lanes.push_back(true);
+        return (int) lanes.size() - 1;
     }
 
-    CmdFuture Cmd::run_async() const {
-        if (parts.empty() || parts[0].empty()) {
-            PANIC("No command to run.");
-        }
+    void Tracer::release_lane(int lane) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (lane >= 0 && (size_t) lane < lanes.size()) lanes[lane] = false;
+    }
 
-        std::cout << "CMD: " << render() << std::endl;
+    void Tracer::span(const string &name, const string &category, int64_t start, int64_t end, int pid, int tid, const string &args) {
+        string event = "{\"name\":\"" + json_escape(name) + "\",\"cat\":\"" + json_escape(category) + "\",\"ph\":\"X\""
+            + ",\"ts\":" + std::to_string(start) + ",\"dur\":" + std::to_string(end - start)
+            + ",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(tid)
+            + ",\"args\":{" + args + "}}";
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(std::move(event));
+    }
 
-        // Pseudo-terminal for line-buffered output
-        int output_fd;
-        pid_t cpid = forkpty(&output_fd, nullptr, nullptr, nullptr);
-        if (cpid < 0) {
-            PANIC("Could not forkpty: " + std::string(strerror(errno)));
+    void Tracer::write() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(file);
+        if (!out.is_open()) {
+            WARNING("Could not write trace: " + file.string());
+            return;
+        }
+        out << "{\"traceEvents\":[\n";
+        for (size_t i = 0; i < events.size(); ++i) {
+            out << events[i] << (i + 1 < events.size() ? ",\n" : "\n");
         }
+        out << "],\"displayTimeUnit\":\"ms\"}\n";
+    }
 
-        if (cpid == 0) {
-            // --- Child process ---
+    std::unique_ptr<Tracer> global_tracer = nullptr;
+    std::once_flag tracer_checked;
 
-            std::vector<char *> args;
-            for (auto &part : parts) {
-                args.push_back(const_cast<char *>(part.c_str()));
-            }
-            args.push_back(nullptr);
+    Tracer &use_tracer(path file) {
+        tracer(); // Do not let a later check of BOB_TRACE replace this tracer
+        global_tracer = std::make_unique<Tracer>(file);
+        return *global_tracer;
+    }
 
-            // Set the current working directory if specified
-            if (!root.empty()) {
-                if (chdir(root.c_str()) < 0) {
-                    std::cerr << "Could not change directory to " << root << ": " << strerror(errno) << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-            }
+    Tracer *tracer() {
+        std::call_once(tracer_checked, []() {
+            const char *file = getenv("BOB_TRACE");
+            if (file && *file && !global_tracer) global_tracer = std::make_unique<Tracer>(file);
+        });
+        return global_tracer.get();
+    }
 
-            // Note: With forkpty, stdout/stderr are already connected to the PTY.
-            // No need for manual dup2 redirection.
+    //! Lane of the current thread in the recipe part of the trace.
+    int trace_thread_lane() {
+        static std::atomic<int> next_lane{0};
+        thread_local int lane = next_lane++;
+        return lane;
+    }
 
-            if (execvp(args[0], args.data()) < 0) {
-                std::cerr << "Could not exec child process: " << strerror(errno) << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            exit(EXIT_SUCCESS);
+    void CmdFuture::trace() {
+        Tracer *t = tracer();
+        if (!t || trace_lane < 0) return;
+        string args = "\"slot\":" + std::to_string(slot)
+            + ",\"exit_code\":" + std::to_string(exit_code)
+            + ",\"max_rss_kb\":" + std::to_string(stats.max_rss_kb)
+            + ",\"user_ms\":" + std::to_string(stats.user_ms)
+            + ",\"sys_ms\":" + std::to_string(stats.sys_ms);
+        if (timed_out) args += ",\"timed_out\":true";
+        if (trace_first_output >= 0) {
+            args += ",\"first_output_ms\":" + std::to_string((trace_first_output - trace_start) / 1000.0);
         }
+        t->span(trace_name, "command", trace_start, t->now(), Tracer::COMMANDS, trace_lane, args);
+        t->release_lane(trace_lane);
+        trace_lane = -1;
+    }
 
-        // --- Parent process ---
+    // Without a pidfd, child exit cannot be waited for directly, so the wait is capped by this timeout.
+    const int FALLBACK_WAIT_MS = 20;
+
+    // How often a throttled `CmdRunner` checks the system load and available memory again.
+    const int RESOURCE_RECHECK_MS = 250;
+
+    // Jobs shorter than this keep their order, since reordering them hardly changes the build time.
+    const int64_t SCHEDULE_MIN_MS = 100;
+
+    // A speculative command gets a second copy when it runs this many times its usual duration,
+    // and at least this many milliseconds longer.
+    const double  SPECULATE_FACTOR = 2.0;
+    const int64_t SPECULATE_MIN_MS = 1000;
+
+    // Block until any of the futures has output available or has exited.
+    void wait_futures(const vector<const CmdFuture *> &futs, int timeout_ms, int extra_fd = -1) {
+        vector<struct pollfd> fds;
+        if (extra_fd >= 0) fds.push_back({extra_fd, POLLIN, 0});
+        bool can_block = true;
+        auto now = std::chrono::steady_clock::now();
+        for (const CmdFuture *fut : futs) {
+            if (fut->done) continue;
+            if (fut->timeout_ms > 0) {
+                // Wake up in time to kill the command when it runs out of time
+                int64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - fut->started).count();
+                int remaining = (int) std::max<int64_t>(0, fut->timeout_ms - elapsed);
+                if (timeout_ms < 0 || remaining < timeout_ms) timeout_ms = remaining;
+            }
+            if (fut->output_fd >= 0 && !fut->output_eof) fds.push_back({fut->output_fd, POLLIN, 0});
+            if (fut->error_fd  >= 0 && !fut->error_eof)  fds.push_back({fut->error_fd,  POLLIN, 0});
+            if (fut->exit_fd >= 0) fds.push_back({fut->exit_fd, POLLIN, 0});
+            else                   can_block = false;
+        }
 
-        // Set master PTY file descriptor to non-blocking mode
-        fcntl(output_fd, F_SETFL, O_NONBLOCK);
+        if (fds.empty() && can_block) return;
 
-        CmdFuture future;
-        future.cpid = cpid;
-        future.output_fd = output_fd;
-        future.done = false;
-        future.silent = silent;
+        if (!can_block && (timeout_ms < 0 || timeout_ms > FALLBACK_WAIT_MS)) timeout_ms = FALLBACK_WAIT_MS;
 
-        return future;
+        if (::poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR) {
+            PANIC("Error while waiting for child processes: " + string(strerror(errno)));
+        }
     }
 
-    int Cmd::run() {
-        CmdFuture fut = run_async();
-        return await_future(fut);
-    }
+    // The pool and queue of the current thread, when it belongs to a `ThreadPool`
+    thread_local ThreadPool *current_pool = nullptr;
+    thread_local size_t current_queue = 0;
 
-    void Cmd::check() {
-        int exit_code = run();
-        if (exit_code != 0) PANIC("Command '" + render() + "' failed with exit status: " + std::to_string(exit_code));
+    ThreadPool::ThreadPool(size_t threads) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < threads; i++) this->threads.emplace_back([this, i] { work(i); });
     }
 
-    void Cmd::clear() {
-        parts.clear();
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &thread : threads) thread.join();
     }
 
-    bool Cmd::poll_future(CmdFuture &fut) {
-        bool done = fut.poll(&output_str);
-        return done;
+    size_t ThreadPool::size() const {
+        return threads.size();
     }
 
-    int Cmd::await_future(CmdFuture &fut) {
-        bool done = false;
-        while (!done) {
-            done = poll_future(fut);
+    void ThreadPool::submit(std::function<void()> function) {
+        bool own = current_pool == this;
+        size_t index;
+        if (own) index = current_queue;
+        else {
+            std::lock_guard<std::mutex> lock(mutex);
+            index = next_queue++ % queues.size();
         }
-        return fut.exit_code;
+        {
+            Queue &queue = *queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (own) queue.functions.push_front(std::move(function));
+            else     queue.functions.push_back(std::move(function));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued++;
+        }
+        wake.notify_one();
     }
 
-    bool CmdRunner::populate_slots() {
-        bool did_work = false;
-        for (size_t i = 0; i < process_count; ++i) {
-            auto &slot = slots[i];
+    void ThreadPool::wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return queued == 0 && active == 0; });
+    }
 
-            if (slot.index >= 0) {
-                bool fut_done = cmds[slot.index].poll_future(slot.fut);
-                if (!fut_done) continue;
+    bool ThreadPool::take(size_t index, std::function<void()> &function) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue &queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.functions.empty()) continue;
+            if (i == 0) {
+                function = std::move(queue.functions.front());
+                queue.functions.pop_front();
+            } else {
+                function = std::move(queue.functions.back());
+                queue.functions.pop_back();
             }
-
-            // Slot is ready!
-
-            set_exit_code(slot);
-
-            if (!any_waiting()) continue;
-
-            // Populate slot with a new command
-            size_t index = cursor++;
-            Cmd cmd = cmds[index];
-
-            slot.fut = cmd.run_async();
-            slot.index = index;
-
-            did_work = true;
+            return true;
         }
-        return did_work;
+        return false;
     }
 
-    void CmdRunner::await_slots() {
-        bool all_done = false;
-        while (!all_done) {
-            all_done = true;
-            for (auto &slot : slots) {
-                if (slot.index < 0) continue;
-                bool done = cmds[slot.index].poll_future(slot.fut);
-                if (done) {
-                    set_exit_code(slot);
-                }
-                all_done &= done;
+    void ThreadPool::work(size_t index) {
+        current_pool = this;
+        current_queue = index;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return queued > 0 || stopping; });
+                if (queued == 0) return;
+                // Every queued function is in a queue before it is counted, so this thread is sure to find one
+                queued--;
+                active++;
+            }
+            std::function<void()> function;
+            while (!take(index, function)) std::this_thread::yield();
+            try {
+                function();
+            } catch (const std::exception &e) {
+                WARNING("Uncaught exception in thread pool: " + string(e.what()));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+                if (queued == 0 && active == 0) idle.notify_all();
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
         }
     }
 
-    void CmdRunner::set_exit_code(CmdRunnerSlot &slot) {
-        if (slot.index < 0) return;
-        exit_codes[slot.index] = slot.fut.exit_code;
+    ThreadPool &thread_pool() {
+        // Never destroyed, so a task calling `exit()` does not join its own thread
+        static ThreadPool *pool = new ThreadPool();
+        return *pool;
     }
 
-    bool CmdRunner::any_waiting() {
-        return cursor < cmds.size();
+    struct TaskState {
+        std::atomic<bool> done = false;
+        int exit_code = -1;
+        string output;
+        // Written once when the task finishes, so the future can wait for it like for a process
+        int notify_fd = -1;
+    };
+
+    CmdFuture::CmdFuture() : cpid(-1), done(false), exit_code(-1) {}
+
+    int CmdFuture::await(string * output) {
+        while (!poll(output)) wait();
+        return exit_code;
     }
 
-    void CmdRunner::init_slots() {
+    void CmdFuture::wait(int timeout_ms) const {
+        wait_futures({this}, timeout_ms);
+    }
+
+    // Adds the resources used by a reaped process to `stats`
+    void add_usage(CmdStats &stats, const struct rusage &usage) {
+        auto ms = [](const struct timeval &tv) { return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0; };
+        stats.user_ms += ms(usage.ru_utime);
+        stats.sys_ms  += ms(usage.ru_stime);
+        stats.max_rss_kb    = std::max<long>(stats.max_rss_kb, usage.ru_maxrss);
+        stats.read_blocks  += usage.ru_inblock;
+        stats.write_blocks += usage.ru_oublock;
+    }
+
+    bool CmdFuture::poll(string * output, string * error) {
+        if (done) return true;
+
+        if (task) {
+            if (!task->done) return false;
+            if (!task->output.empty()) consume(task->output, output, tail, false);
+            finish_output(output, tail);
+            close_fds();
+            done = true;
+            exit_code = task->exit_code;
+            stats.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            trace();
+            return true;
+        }
+
+        auto read_output = [this, output, error]() {
+            if (output_fd >= 0 && !output_eof) {
+                read_fd(output_fd, [this, output](std::string_view chunk) {
+                    consume(chunk, output, tail, false);
+                }, &output_eof);
+            }
+            if (error_fd >= 0 && !error_eof) {
+                string * target = error ? error : output;
+                OutputTail &target_tail = error ? error_tail : tail;
+                read_fd(error_fd, [this, target, &target_tail](std::string_view chunk) {
+                    consume(chunk, target, target_tail, true);
+                }, &error_eof);
+            }
+        };
+
+        read_output();
+
+        int status;
+        struct rusage usage;
+
+        // The last stage of a pipeline is only reaped after the earlier ones. `exit_fd` belongs to
+        // the first stage that is still running, which changes when it is reaped.
+        auto first_running = [this]() {
+            for (pid_t pid : stage_pids) if (pid >= 0) return pid;
+            return cpid;
+        };
+        pid_t watched = first_running();
+        pid_t waiting = -1;
+        for (size_t i = 0; i < stage_pids.size(); i++) {
+            if (stage_pids[i] < 0) continue;
+            pid_t reaped = wait4(stage_pids[i], &status, WNOHANG, &usage);
+            if (reaped == -1) PANIC("Error while polling child process: " + string(strerror(errno)));
+            if (reaped == 0) {
+                if (waiting < 0) waiting = stage_pids[i];
+                continue;
+            }
+            stage_exit_codes[i] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            stage_pids[i] = -1;
+            add_usage(stats, usage);
+        }
+        if (first_running() != watched && exit_fd >= 0) {
+            close(exit_fd);
+            exit_fd = open_exit_fd(first_running());
+        }
+
+        pid_t result = waiting >= 0 ? 0 : wait4(cpid, &status, WNOHANG, &usage);
+
+        if (result == -1) PANIC("Error while polling child process: " + string(strerror(errno)));
+
+        if (result == 0) {
+            if (timeout_ms <= 0) return false;
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            if (elapsed < timeout_ms) return false;
+
+            // Out of time, keep the output so far and kill the command
+            read_output();
+            consume("\n[TIMEOUT] Killed after " + std::to_string(timeout_ms) + " ms\n", output, tail, false);
+            finish_output(output, tail);
+            finish_output(error ? error : output, error_tail);
+            stats.wall_ms = elapsed;
+            timed_out = true;
+            kill(TIMEOUT_EXIT_CODE);
+            return true;
+        }
+        unregister_process_group(pgid);
+
+        // Collect output written right before the child exited
+        read_output();
+        finish_output(output, tail);
+        finish_output(error ? error : output, error_tail);
+
+        close_fds();
+
+        done = true;
+        stats.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        add_usage(stats, usage);
+        if (WIFEXITED(status)) exit_code = WEXITSTATUS(status);
+        // Like `set -o pipefail`, the last failed stage decides the exit code
+        for (size_t i = stage_exit_codes.size(); exit_code == 0 && i > 0; i--) exit_code = stage_exit_codes[i - 1];
+        trace();
+        if (!WIFEXITED(status)) PANIC("Child process did not terminate normally.");
+        return true;
+    }
+
+    void CmdFuture::close_fds() {
+        for (int *fd : {&output_fd, &error_fd, &exit_fd}) {
+            if (*fd >= 0) close(*fd);
+            *fd = -1;
+        }
+    }
+
+    void CmdFuture::consume(std::string_view chunk, string * output, OutputTail &tail, bool is_error) {
+        if (trace_lane >= 0 && trace_first_output < 0) trace_first_output = tracer()->now();
+        if (!silent) {
+            std::ostream &stream = is_error ? std::cerr : std::cout;
+            stream.write(chunk.data(), chunk.size());
+        }
+        if (on_output) on_output(chunk);
+        if (!output) return;
+
+        if (output_limit == 0) {
+            output->append(chunk);
+            return;
+        }
+
+        // Fill the head first...
+        size_t head_limit = output_limit / 2;
+        if (tail.total == 0 && output->size() < head_limit) {
+            size_t n = std::min(chunk.size(), head_limit - output->size());
+            output->append(chunk.substr(0, n));
+            chunk.remove_prefix(n);
+        }
+
+        // ...and keep the rest in a ring buffer
+        size_t tail_limit = output_limit - head_limit;
+        tail.total += chunk.size();
+        if (chunk.size() >= tail_limit) {
+            tail.data.assign(chunk.substr(chunk.size() - tail_limit));
+            tail.pos = 0;
+            return;
+        }
+        if (tail.data.size() < tail_limit) {
+            size_t n = std::min(chunk.size(), tail_limit - tail.data.size());
+            tail.data.append(chunk.substr(0, n));
+            chunk.remove_prefix(n);
+        }
+        while (!chunk.empty()) {
+            size_t n = std::min(chunk.size(), tail_limit - tail.pos);
+            tail.data.replace(tail.pos, n, chunk.substr(0, n));
+            tail.pos = (tail.pos + n) % tail_limit;
+            chunk.remove_prefix(n);
+        }
+    }
+
+    void CmdFuture::finish_output(string * output, OutputTail &tail) {
+        if (!output || tail.total == 0) return;
+        size_t dropped = tail.total - tail.data.size();
+        if (dropped > 0) *output += "\n[... " + std::to_string(dropped) + " bytes omitted ...]\n";
+        output->append(tail.data, tail.pos, string::npos);
+        output->append(tail.data, 0, tail.pos);
+        tail = OutputTail();
+    }
+
+    bool CmdFuture::kill(int code) {
+        if (cpid < 0) return false;
+        // Kill the whole process group, so processes started by the command (like `cc1` under `gcc`) die too
+        pid_t group = pgid >= 0 ? pgid : cpid;
+        if (::kill(-group, SIGKILL) < 0 && ::kill(cpid, SIGKILL) < 0) {
+            std::cerr << "Failed to kill child process: " << strerror(errno) << std::endl;
+            return false;
+        }
+        // Reaped with `wait4`, so `stats` also covers killed commands, like those which timed out
+        struct rusage usage;
+        for (pid_t &pid : stage_pids) {
+            if (pid < 0) continue;
+            pid_t reaped;
+            while ((reaped = wait4(pid, nullptr, 0, &usage)) < 0 && errno == EINTR) {}
+            if (reaped == pid) add_usage(stats, usage);
+            pid = -1;
+        }
+        pid_t reaped;
+        while ((reaped = wait4(cpid, nullptr, 0, &usage)) < 0 && errno == EINTR) {}
+        if (reaped == cpid) add_usage(stats, usage);
+        unregister_process_group(group);
+        close_fds();
+        // Reset the state
+        cpid = -1;
+        done = true;
+        exit_code = code;
+        trace();
+
+        return true;
+    }
+
+    Cmd::Cmd(vector<string> &&parts, path root) : parts(std::move(parts)), root(root) {}
+
+    Cmd::Cmd(TaskFunc task, string name) : parts({std::move(name)}), task(std::move(task)) {}
+
+    Cmd& Cmd::push(string part) {
+        parts.push_back(std::move(part));
+        return *this;
+    }
+
+    Cmd& Cmd::push_many(const vector<string> &parts) {
+        this->parts.insert(this->parts.end(), parts.begin(), parts.end());
+        return *this;
+    }
+
+    const vector<string> &Cmd::get_parts() const {
+        return parts;
+    }
+
+    string Cmd::render() const {
+        string result;
+        for (const auto &part : parts) {
+            if (!result.empty()) result += " ";
+            result += part;
+        }
+        if (root != ".") {
+            path rel_root = fs::relative(root, fs::current_path());
+            result = "[from '" + rel_root.string() + "'] " + result;
+        }
+        // Rendered like a shell pipeline, with the input after the first stage
+        string input = stdin_file.empty() ? "" : " < " + stdin_file.string();
+        if (!stages.empty()) {
+            string pipeline = stages[0].render() + input;
+            for (size_t i = 1; i < stages.size(); i++) pipeline += " | " + stages[i].render();
+            result = pipeline + " | " + result;
+        } else {
+            result += input;
+        }
+        if (!stdout_file.empty()) result += " > " + stdout_file.string();
+        return result;
+    }
+
+    const vector<Cmd> &Cmd::get_stages() const {
+        return stages;
+    }
+
+    Cmd operator|(Cmd left, Cmd right) {
+        if (left.task || right.task) PANIC("Tasks cannot be part of a pipeline.");
+
+        // Flatten both sides, so `a | (b | c)` is the same as `(a | b) | c`
+        vector<Cmd> stages = std::move(left.stages);
+        path stdin_file = left.stdin_file;
+        left.stdin_file = "";
+        left.stdout_file = "";
+        stages.push_back(std::move(left));
+        for (Cmd &stage : right.stages) {
+            stage.stdin_file = "";
+            stage.stdout_file = "";
+            stages.push_back(std::move(stage));
+        }
+        for (Cmd &stage : stages) stage.stages.clear();
+
+        right.stages = std::move(stages);
+        right.stdin_file = stdin_file;
+        return right;
+    }
+
+    string hex(uint64_t value) {
+        std::ostringstream oss;
+        oss << std::hex << value;
+        return oss.str();
+    }
+
+    // A temporary name next to `file`, unique across processes and threads
+    path temp_path(const path &file) {
+        static std::atomic<uint64_t> counter = 0;
+        path tmp = file;
+        tmp += "." + std::to_string(getpid()) + "-" + std::to_string(counter++) + ".tmp";
+        return tmp;
+    }
+
+    // Writes `content` to a temporary file and renames it to `file`, so readers never see a partial file
+    bool write_atomically(const path &file, const string &content) {
+        path tmp = temp_path(file);
+        std::ofstream out(tmp, std::ios::binary);
+        out << content;
+        out.close();
+        if (!out || rename(tmp.c_str(), file.c_str()) < 0) {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            return false;
+        }
+        return true;
+    }
+
+    //! Checks if a tool reads `@file` response files, also with a cross-compiler prefix or version suffix.
+    bool supports_response_files(const string &tool) {
+        string name = path(tool).filename().string();
+        size_t version = name.find_last_not_of("0123456789.");
+        if (version != string::npos && version + 1 < name.size() && name[version] == '-') name.erase(version);
+        size_t dash = name.rfind('-');
+        if (dash != string::npos) name.erase(0, dash + 1);
+        static const std::unordered_set<string> tools = {
+            "gcc", "g++", "cc", "c++", "clang", "clang++", "ld", "ld.bfd", "ld.gold", "ld.lld", "lld", "ar",
+        };
+        return tools.count(name) > 0;
+    }
+
+    const vector<string> &Cmd::response_file_parts(vector<string> &storage) const {
+        if (response_file_limit == 0 || parts.size() < 2) return parts;
+
+        size_t length = 0;
+        for (size_t i = 1; i < parts.size(); i++) length += parts[i].size() + 1;
+        if (length <= response_file_limit || !supports_response_files(parts[0])) return parts;
+
+        // One argument per line, with whitespace, quotes and backslashes escaped like GNU tools expect
+        string content;
+        content.reserve(length * 2);
+        for (size_t i = 1; i < parts.size(); i++) {
+            for (char c : parts[i]) {
+                if (isspace((unsigned char) c) || c == '\\' || c == '"' || c == '\'') content += '\\';
+                content += c;
+            }
+            content += '\n';
+        }
+
+        // Named by content, so an unchanged argument list reuses the existing file
+        path dir = fs::absolute(".bob/rsp");
+        path file = dir / (hex(hash_string(content)) + ".rsp");
+        if (stat_file(file).size != content.size()) {
+            std::error_code ec;
+            fs::create_directories(dir, ec);
+            if (!write_atomically(file, content)) {
+                WARNING("Could not write response file " + file.string() + ", passing arguments directly.");
+                return parts;
+            }
+        }
+
+        storage = {parts[0], "@" + file.string()};
+        return storage;
+    }
+
+    // A null terminated argv pointing into the parts of a command. The strings are not copied,
+    // so the only allocation is the pointer array, made before forking.
+    vector<char *> argv_of(const vector<string> &command) {
+        vector<char *> args;
+        args.reserve(command.size() + 1);
+        for (const string &part : command) args.push_back(const_cast<char *>(part.c_str()));
+        args.push_back(nullptr);
+        return args;
+    }
+
+    pid_t Cmd::spawn_pty(const vector<string> &command, int &output_fd) const {
+        string exe = resolve_executable(command[0]);
+        vector<char *> args = argv_of(command);
+        // Redirects are relative to bob, not to the root of the command
+        string in_file  = stdin_file.empty()  ? "" : fs::absolute(stdin_file).string();
+        string out_file = stdout_file.empty() ? "" : fs::absolute(stdout_file).string();
+
+        // Pseudo-terminal for line-buffered output. Both ends are opened close-on-exec, so commands
+        // spawned by other threads at the same time never inherit them.
+        output_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        char slave_name[128];
+        if (output_fd < 0 || grantpt(output_fd) < 0 || unlockpt(output_fd) < 0
+            || ptsname_r(output_fd, slave_name, sizeof(slave_name)) != 0) {
+            PANIC("Could not open a pseudo-terminal: " + std::string(strerror(errno)));
+        }
+        int slave_fd = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (slave_fd < 0) PANIC("Could not open " + string(slave_name) + ": " + std::string(strerror(errno)));
+
+        pid_t cpid = fork();
+        if (cpid < 0) {
+            PANIC("Could not fork: " + std::string(strerror(errno)));
+        }
+
+        if (cpid == 0) {
+            // --- Child process ---
+
+            pthread_sigmask(SIG_SETMASK, &spawn_sigmask, nullptr);
+            // Start a new session with the terminal as its stdio, so the child also leads its own
+            // process group
+            if (login_tty(slave_fd) < 0) _exit(EXIT_FAILURE);
+
+            // Set the current working directory if specified
+            if (!root.empty()) {
+                if (chdir(root.c_str()) < 0) {
+                    std::cerr << "Could not change directory to " << root << ": " << strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            // Note: With forkpty, stdout/stderr are already connected to the PTY.
+            // Only redirects to files need a dup2.
+            if (!in_file.empty()) {
+                int fd = open(in_file.c_str(), O_RDONLY);
+                if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+                    std::cerr << "Could not open " << in_file << ": " << strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                close(fd);
+            }
+            if (!out_file.empty()) {
+                int fd = open(out_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+                    std::cerr << "Could not open " << out_file << ": " << strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                close(fd);
+            }
+
+            // Like a shell, a command which cannot be started exits with 127
+            execvp(exe.c_str(), args.data());
+            std::cerr << "Could not spawn '" << command[0] << "': " << strerror(errno) << std::endl;
+            _exit(127);
+        }
+
+        // --- Parent process ---
+
+        close(slave_fd);
+        fcntl(output_fd, F_SETFL, O_NONBLOCK);
+
+        return cpid;
+    }
+
+    // Spawns a process in the process group `pgid` (a new one when it is 0) which writes `message`
+    // to `err_fd` and exits with `code`. It stands in for a command which could not be started,
+    // so the failure is reported like the exit of the command, and a pipeline is not left half spawned.
+    pid_t spawn_failure(const string &message, int err_fd, pid_t pgid, int code) {
+        pid_t cpid = fork();
+        if (cpid < 0) PANIC("Could not fork: " + string(strerror(errno)));
+        if (cpid == 0) {
+            setpgid(0, pgid);
+            ssize_t written = write(err_fd, message.data(), message.size());
+            (void) written;
+            _exit(code);
+        }
+        setpgid(cpid, pgid == 0 ? cpid : pgid);
+        return cpid;
+    }
+
+    // Spawns `command` in `root` with the given stdio, in the process group `pgid` or a new one when it is 0.
+    // A negative `in_fd` reads stdin from /dev/null. If the command cannot be started, the process
+    // exits with 127 like in a shell.
+    pid_t spawn_process(const vector<string> &command, const path &root, int in_fd, int out_fd, int err_fd, pid_t pgid) {
+        vector<char *> args = argv_of(command);
+        string exe = resolve_executable(command[0]);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (in_fd < 0) posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        else           posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+        // Every command gets its own process group, which `CmdFuture::kill()` kills as a whole
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigmask(&attr, &spawn_sigmask);
+
+        pid_t cpid = -1;
+        int result;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+        if (!root.empty()) posix_spawn_file_actions_addchdir_np(&actions, root.c_str());
+        result = posix_spawnp(&cpid, exe.c_str(), &actions, &attr, args.data(), environ);
+#else
+        if (root.empty()) {
+            result = posix_spawnp(&cpid, exe.c_str(), &actions, &attr, args.data(), environ);
+        } else {
+            // No way to change directory with posix_spawn, fall back to fork
+            cpid = fork();
+            result = cpid < 0 ? errno : 0;
+            if (cpid == 0) {
+                setpgid(0, pgid);
+                pthread_sigmask(SIG_SETMASK, &spawn_sigmask, nullptr);
+                if (in_fd < 0) in_fd = open("/dev/null", O_RDONLY);
+                if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+                dup2(out_fd, STDOUT_FILENO);
+                dup2(err_fd, STDERR_FILENO);
+                if (chdir(root.c_str()) < 0) _exit(127);
+                execvp(exe.c_str(), args.data());
+                _exit(127);
+            }
+        }
+#endif
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if (result != 0) {
+            return spawn_failure("Could not spawn '" + command[0] + "': " + strerror(result) + "\n", err_fd, pgid, 127);
+        }
+        return cpid;
+    }
+
+    // Opens a file for the stdin or stdout of a command, close-on-exec like the pipes.
+    // Returns -1 and sets `error` if it cannot be opened.
+    int open_redirect(const path &file, bool write, string &error) {
+        int fd = write ? open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+                       : open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) error = "Could not open " + file.string() + ": " + strerror(errno) + "\n";
+        return fd;
+    }
+
+    pid_t Cmd::spawn_pipe(const vector<string> &command, int &output_fd, int * error_fd, vector<pid_t> &stage_pids) const {
+        // Pipes are created close-on-exec, so concurrently spawned commands never inherit them
+        int out[2];
+        int err[2] = {-1, -1};
+        if (pipe2(out, O_CLOEXEC) < 0) PANIC("Could not create pipe: " + string(strerror(errno)));
+        if (error_fd && pipe2(err, O_CLOEXEC) < 0) PANIC("Could not create pipe: " + string(strerror(errno)));
+        int err_fd = error_fd ? err[1] : out[1];
+
+        // Each stage reads the pipe written by the one before, and they all share the process group of
+        // the first. Like in a shell, the process with a redirect which cannot be opened fails with 1.
+        string in_error, out_error;
+        int in_fd = stdin_file.empty() ? -1 : open_redirect(stdin_file, false, in_error);
+        pid_t pgid = 0;
+        for (const Cmd &stage : stages) {
+            int next[2];
+            if (pipe2(next, O_CLOEXEC) < 0) PANIC("Could not create pipe: " + string(strerror(errno)));
+            vector<string> rsp_parts;
+            pid_t pid = (pgid == 0 && !in_error.empty())
+                ? spawn_failure(in_error, err_fd, pgid, 1)
+                : spawn_process(stage.response_file_parts(rsp_parts), stage.root, in_fd, next[1], err_fd, pgid);
+            if (pgid == 0) pgid = pid;
+            stage_pids.push_back(pid);
+            if (in_fd >= 0) close(in_fd);
+            close(next[1]);
+            in_fd = next[0];
+        }
+
+        int out_fd = stdout_file.empty() ? out[1] : open_redirect(stdout_file, true, out_error);
+        if (stages.empty() && out_error.empty()) out_error = in_error;
+        pid_t cpid = out_error.empty() ? spawn_process(command, root, in_fd, out_fd, err_fd, pgid)
+                                       : spawn_failure(out_error, err_fd, pgid, 1);
+
+        if (in_fd >= 0) close(in_fd);
+        if (out_fd >= 0 && out_fd != out[1]) close(out_fd);
+        close(out[1]);
+        if (error_fd) close(err[1]);
+
+        output_fd = out[0];
+        fcntl(output_fd, F_SETFL, O_NONBLOCK);
+        if (error_fd) {
+            *error_fd = err[0];
+            fcntl(*error_fd, F_SETFL, O_NONBLOCK);
+        }
+        return cpid;
+    }
+
+    CmdFuture Cmd::run_async() const {
+        if (parts.empty() || parts[0].empty()) {
+            PANIC("No command to run.");
+        }
+
+        if (echo) std::cout << (task ? "TASK: " : "CMD: ") << render() << std::endl;
+
+        auto started = std::chrono::steady_clock::now();
+        Tracer *t = tracer();
+        int64_t trace_start = t ? t->now() : 0;
+
+        CmdFuture future;
+        future.started = started;
+        future.done = false;
+        future.silent = silent;
+
+        if (task) {
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) < 0) PANIC("Could not create pipe: " + string(strerror(errno)));
+            auto state = std::make_shared<TaskState>();
+            state->notify_fd = fds[1];
+            TaskFunc function = task;
+            thread_pool().submit([state, function] {
+                BuildErrorScope scope; // A panicking task fails instead of exiting from a pool thread
+                try {
+                    state->exit_code = function(state->output);
+                } catch (const std::exception &e) {
+                    state->output += string(e.what()) + "\n";
+                    state->exit_code = 1;
+                } catch (...) {
+                    state->output += "Task failed with an unknown exception\n";
+                    state->exit_code = 1;
+                }
+                // Notify before publishing `done`, since the future closes the pipe once it sees it
+                char byte = 1;
+                while (write(state->notify_fd, &byte, 1) < 0 && errno == EINTR) {}
+                close(state->notify_fd);
+                state->done = true;
+            });
+            future.task = state;
+            future.output_fd = -1;
+            future.exit_fd = fds[0];
+        } else {
+            pid_t cpid;
+            int output_fd = -1;
+            int error_fd = -1;
+            vector<string> rsp_parts;
+            const vector<string> &args = response_file_parts(rsp_parts);
+            SpawnGuard guard;
+            if (spawn == SpawnMode::Pipe || !stages.empty()) {
+                cpid = spawn_pipe(args, output_fd, separate_stderr ? &error_fd : nullptr, future.stage_pids);
+            } else {
+                cpid = spawn_pty(args, output_fd);
+            }
+
+            future.pgid = future.stage_pids.empty() ? cpid : future.stage_pids[0];
+            future.stage_exit_codes.assign(future.stage_pids.size(), 0);
+            register_process_group(future.pgid);
+
+            future.cpid = cpid;
+            future.output_fd = output_fd;
+            future.error_fd = error_fd;
+            // A pipeline is done when all of its stages are, so it waits for the first stage first
+            future.exit_fd = open_exit_fd(future.pgid);
+            future.timeout_ms = timeout_ms;
+        }
+        future.output_limit = output_limit;
+        future.on_output = on_output;
+        if (t) {
+            future.trace_name = render();
+            future.trace_lane = t->acquire_lane();
+            future.trace_start = trace_start;
+        }
+
+        if (!output_file.empty()) {
+            auto file = std::make_shared<std::ofstream>(output_file, std::ios::binary);
+            if (!file->is_open()) PANIC("Could not open output file: " + output_file.string());
+            OutputFunc forward = on_output;
+            future.on_output = [file, forward](std::string_view chunk) {
+                file->write(chunk.data(), chunk.size());
+                if (forward) forward(chunk);
+            };
+        }
+
+        return future;
+    }
+
+    int Cmd::run() {
+        int exit_code = 0;
+        for (size_t attempt = 0; attempt <= retries; attempt++) {
+            if (attempt > 0) {
+                output_str.clear();
+                error_str.clear();
+            }
+            CmdFuture fut = run_async();
+            exit_code = await_future(fut);
+            if (exit_code == 0) break;
+        }
+        return exit_code;
+    }
+
+    void Cmd::check() {
+        int exit_code = run();
+        if (exit_code != 0) PANIC("Command '" + render() + "' failed with exit status: " + std::to_string(exit_code));
+    }
+
+    void Cmd::clear() {
+        parts.clear();
+        stages.clear();
+    }
+
+    bool Cmd::poll_future(CmdFuture &fut) {
+        bool done = fut.poll(&output_str, separate_stderr ? &error_str : nullptr);
+        if (done) stats = fut.stats;
+        return done;
+    }
+
+    int Cmd::await_future(CmdFuture &fut) {
+        while (!poll_future(fut)) fut.wait();
+        return fut.exit_code;
+    }
+
+    Jobserver::Jobserver(size_t jobs) : owner(true) {
+        if (jobs == 0) jobs = 1;
+        // The pipe is inherited by child processes, so it must not be close-on-exec
+        int fds[2];
+        if (pipe(fds) < 0) PANIC("Could not create jobserver pipe: " + string(strerror(errno)));
+        pipe_read_fd = fds[0];
+        write_fd = fds[1];
+        auth = std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+
+        // This process owns the implicit slot, the other slots are tokens
+        string tokens(jobs - 1, '+');
+        if (!tokens.empty() && write(write_fd, tokens.data(), tokens.size()) != (ssize_t) tokens.size()) {
+            PANIC("Could not fill jobserver pipe: " + string(strerror(errno)));
+        }
+
+        // Read through a private file description, so non-blocking mode does not leak to children
+        read_fd = open(("/proc/self/fd/" + std::to_string(fds[0])).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (read_fd < 0) PANIC("Could not open jobserver pipe: " + string(strerror(errno)));
+
+        // Added to the flags of the user, where the later `-j` and `--jobserver-auth` win
+        const char *flags = getenv("MAKEFLAGS");
+        string makeflags = flags && *flags ? string(flags) + " " : "";
+        makeflags += "-j" + std::to_string(jobs) + " --jobserver-auth=" + auth;
+        setenv("MAKEFLAGS", makeflags.c_str(), 1);
+    }
+
+    Jobserver::Jobserver(const string &auth) : auth(auth) {
+        if (auth.rfind("fifo:", 0) == 0) {
+            string fifo = auth.substr(5);
+            read_fd  = open(fifo.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            write_fd = open(fifo.c_str(), O_WRONLY | O_CLOEXEC);
+            return;
+        }
+
+        size_t comma = auth.find(',');
+        if (comma == string::npos) return;
+        int inherited_read  = atoi(auth.substr(0, comma).c_str());
+        int inherited_write = atoi(auth.substr(comma + 1).c_str());
+
+        // make closes the pipe for recipes that are not marked with `+`
+        if (fcntl(inherited_read, F_GETFD) < 0 || fcntl(inherited_write, F_GETFD) < 0) return;
+
+        write_fd = inherited_write;
+        read_fd = open(("/proc/self/fd/" + std::to_string(inherited_read)).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+
+    Jobserver::~Jobserver() {
+        // Hand back tokens that are still held, so the parent does not lose slots
+        while (held > 0) release();
+        if (read_fd >= 0) close(read_fd);
+        if (pipe_read_fd >= 0) close(pipe_read_fd);
+        if (owner || auth.rfind("fifo:", 0) == 0) {
+            if (write_fd >= 0) close(write_fd);
+        }
+    }
+
+    bool Jobserver::valid() const {
+        return read_fd >= 0 && write_fd >= 0;
+    }
+
+    bool Jobserver::try_acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!implicit_used) {
+            implicit_used = true;
+            return true;
+        }
+        char token;
+        if (read(read_fd, &token, 1) != 1) return false;
+        held++;
+        return true;
+    }
+
+    void Jobserver::release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (held == 0) {
+            implicit_used = false;
+            return;
+        }
+        char token = '+';
+        while (write(write_fd, &token, 1) < 0 && errno == EINTR) {}
+        held--;
+    }
+
+    int Jobserver::fd() const {
+        return read_fd;
+    }
+
+    std::unique_ptr<Jobserver> global_jobserver = nullptr;
+    std::once_flag jobserver_checked;
+
+    //! Connects to the jobserver of a parent `make`, if there is one.
+    void connect_jobserver() {
+        const char *makeflags = getenv("MAKEFLAGS");
+        if (!makeflags) return;
+
+        // The last occurrence wins. `--jobserver-fds` is the name used before make 4.2.
+        string flags = makeflags;
+        string auth = "";
+        for (const char *option : {"--jobserver-auth=", "--jobserver-fds="}) {
+            size_t pos = flags.rfind(option);
+            if (pos == string::npos) continue;
+            pos += strlen(option);
+            auth = flags.substr(pos, flags.find(' ', pos) - pos);
+            break;
+        }
+        if (auth.empty()) return;
+
+        auto server = std::make_unique<Jobserver>(auth);
+        if (!server->valid()) {
+            WARNING("Jobserver unavailable, running without it. Mark the recipe running bob with `+` in your Makefile.");
+            return;
+        }
+        global_jobserver = std::move(server);
+    }
+
+    Jobserver *jobserver() {
+        std::call_once(jobserver_checked, connect_jobserver);
+        return global_jobserver.get();
+    }
+
+    Jobserver &use_jobserver(size_t jobs) {
+        if (Jobserver *js = jobserver()) return *js;
+        global_jobserver = std::make_unique<Jobserver>(jobs);
+        return *global_jobserver;
+    }
+
+    // Quotes a string for sh
+    string shell_quote(const string &text) {
+        string result = "'";
+        for (char c : text) {
+            if (c == '\'') result += "'\\''";
+            else            result += c;
+        }
+        return result + "'";
+    }
+
+    // Checks if a relative path stays inside the directory it is relative to
+    bool is_inside(const path &file) {
+        if (file.is_absolute()) return false;
+        path normal = file.lexically_normal();
+        return normal.empty() || *normal.begin() != "..";
+    }
+
+    RemoteWorkers::RemoteWorkers(const vector<string> &hosts, size_t slots) {
+        for (const string &host : hosts) {
+            size_t slash = host.rfind('/');
+            if (slash == string::npos) {
+                add(host, slots);
+                continue;
+            }
+            string count = host.substr(slash + 1);
+            if (slash == 0 || count.empty() || count.size() > 6 || count.find_first_not_of("0123456789") != string::npos) {
+                WARNING("Ignoring worker '" + host + "', expected a host optionally followed by '/' and its number of slots.");
+                continue;
+            }
+            add(host.substr(0, slash), std::stoul(count));
+        }
+    }
+
+    void RemoteWorkers::add(const string &host, size_t slots) {
+        std::lock_guard<std::mutex> lock(mutex);
+        workers.push_back({host, std::max<size_t>(slots, 1), 0});
+    }
+
+    size_t RemoteWorkers::capacity() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t result = 0;
+        for (const Worker &worker : workers) result += worker.slots;
+        return result;
+    }
+
+    size_t RemoteWorkers::available() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t result = 0;
+        for (const Worker &worker : workers) result += worker.slots - worker.running;
+        return result;
+    }
+
+    int RemoteWorkers::acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        int best = -1;
+        double best_load = 1;
+        for (size_t i = 0; i < workers.size(); i++) {
+            double load = (double) workers[i].running / workers[i].slots;
+            if (load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+        if (best >= 0) workers[best].running++;
+        return best;
+    }
+
+    void RemoteWorkers::release(int worker) {
+        std::lock_guard<std::mutex> lock(mutex);
+        assert(worker >= 0 && worker < (int) workers.size() && workers[worker].running > 0);
+        workers[worker].running--;
+    }
+
+    string RemoteWorkers::host(int worker) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return workers[worker].host;
+    }
+
+    bool RemoteWorkers::can_run(const Cmd &cmd) {
+        if (!cmd.hermetic || cmd.task || !cmd.get_stages().empty() || cmd.get_parts().empty() || !is_inside(cmd.root)) return false;
+        for (const path &input : cmd.inputs) {
+            if (!input.is_absolute() && !is_inside(input)) return false;
+        }
+        for (const path &output : cmd.outputs) {
+            if (!is_inside(output)) return false;
+        }
+        return true;
+    }
+
+    void RemoteWorkers::discard(const path &staged) {
+        std::error_code ec;
+        fs::remove_all(staged, ec);
+        for (const char *ext : {".list", ".missing", ".in", ".sh"}) fs::remove(staged.string() + ext, ec);
+    }
+
+    bool RemoteWorkers::remote(const Cmd &cmd, int worker, Cmd &result, path &staged) {
+        string id;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::system_clock::now().time_since_epoch().count();
+            id = hex(hash_string(std::to_string(getpid()) + " " + std::to_string(jobs++) + " " + std::to_string(now)));
+        }
+
+        string connect;
+        for (const string &part : ssh) connect += shell_quote(part) + " ";
+        connect += shell_quote(host(worker));
+
+        std::error_code ec;
+        path local = fs::absolute(".bob/remote/jobs") / id;
+        auto abandon = [&]() {
+            discard(local);
+            return false;
+        };
+        fs::create_directories(local, ec);
+        if (ec) return abandon();
+
+        string base  = shell_quote(remote_dir);
+        string cas   = shell_quote(remote_dir + "/cas");
+        string job   = "job-" + id + ".sh";
+
+        // The inputs are snapshotted under their content hash, so later edits can't reach the worker.
+        // A copy not matching the hash means the input was unreadable or changed since it was hashed.
+        string list = job + "\n";
+        string layout = "";
+        BuildDb *db = build_db();
+        for (const path &input : cmd.inputs) {
+            if (input.is_absolute()) continue;
+            string name = hex(db ? db->hash(input) : hash_file(input));
+            path copy = local / name;
+            if (!fs::exists(copy, ec)) {
+                fs::copy_file(input, copy, ec);
+                if (ec || hex(hash_file(copy)) != name) return abandon();
+            }
+            list += name + "\n";
+            path target = input.lexically_normal();
+            if (target.has_parent_path()) layout += "mkdir -p " + shell_quote(target.parent_path().string()) + " && ";
+            layout += "cp \"$B/cas/" + name + "\" " + shell_quote(target.string()) + " || exit 255\n";
+        }
+
+        string command = "";
+        for (const string &part : cmd.get_parts()) command += shell_quote(part) + " ";
+
+        string outputs = "";
+        for (const path &output : cmd.outputs) {
+            path target = output.lexically_normal();
+            if (target.has_parent_path()) layout += "mkdir -p " + shell_quote(target.parent_path().string()) + " || exit 255\n";
+            outputs += " " + shell_quote(target.string());
+        }
+
+        // Runs on the worker, from the home directory. Its stdin stays open until the local side is
+        // killed or done, and then the job kills everything it started and removes its directory.
+        std::ofstream script(local / job);
+        script
+            << "B=$(cd " << base << " && pwd) || exit 255\n"
+            << "J=\"$B/jobs/" << id << "\"\n"
+            << "rm -f \"$B/cas/" << job << "\"\n"
+            << "trap 'rm -rf \"$J\" \"$J.tar\"; exit 143' TERM\n"
+            << "mkdir -p \"$J\" && cd \"$J\" || exit 255\n"
+            << "exec 3<&0\n"
+            << "{ cat > /dev/null; kill 0; } <&3 > /dev/null 2>&1 &\n"
+            << "exec 3<&-\n"
+            << layout
+            << "(cd " << shell_quote(cmd.root.string()) << " && exec " << command << ")\n"
+            << "code=$?\n"
+            << "if [ $code -eq 0 ]; then tar -cf \"$J.tar\"" << outputs << " || code=1; fi\n"
+            << "exit $code\n";
+        script.close();
+        std::ofstream listing(local.string() + ".list");
+        listing << list;
+        listing.close();
+        if (script.fail() || listing.fail()) return abandon();
+
+        // Runs locally: ships the missing inputs, runs the job and extracts its outputs. Inputs are
+        // extracted next to the store and moved into it, so it never holds partly written files.
+        // The job reads a FIFO which only this script holds open, so killing the script ends the job.
+        string missing = local.string() + ".missing";
+        string fifo = shell_quote(local.string() + ".in");
+        string extract = "cd " + cas + " && t=$(mktemp -d .in-XXXXXX) && tar -xf - -C \"$t\""
+                       + " && for f in \"$t\"/*; do test ! -e \"$f\" || mv -f \"$f\" .; done; s=$?; rm -rf \"$t\"; exit $s";
+        string fetch = shell_quote("cd " + base + "/jobs && { test ! -e " + id + ".tar || cat " + id + ".tar; }; rm -rf " + id + " " + id + ".tar");
+        std::ofstream runner(local.string() + ".sh");
+        runner
+            << connect << " " << shell_quote("mkdir -p " + cas + " && cd " + cas
+                   + " && while read h; do test -e \"$h\" || echo \"$h\"; done")
+            << " < " << shell_quote(local.string() + ".list") << " > " << shell_quote(missing) << " || exit 255\n"
+            << "tar -cf - -C " << shell_quote(local.string()) << " -T " << shell_quote(missing)
+            << " | " << connect << " " << shell_quote(extract) << " || exit 255\n"
+            << "rm -f " << fifo << " && mkfifo " << fifo << " || exit 255\n"
+            << connect << " " << shell_quote("sh " + cas + "/" + job) << " < " << fifo << " &\n"
+            << "exec 3> " << fifo << "\n"
+            << "wait $!\n"
+            << "code=$?\n"
+            << "exec 3>&-\n"
+            << "if [ $code -eq 0 ]; then " << connect << " " << fetch << " < /dev/null | tar -xf - || code=1\n"
+            << "else " << connect << " " << fetch << " < /dev/null > /dev/null; fi\n"
+            << "exit $code\n";
+        runner.close();
+        if (runner.fail()) return abandon();
+
+        result = cmd;
+        result.clear();
+        result.push_many({"sh", local.string() + ".sh"});
+        result.root = ".";
+        result.echo = false;
+        result.hermetic = false;
+        result.inputs.clear();
+        result.outputs.clear();
+        staged = local;
+        return true;
+    }
+
+    std::unique_ptr<RemoteWorkers> global_remote_workers = nullptr;
+    std::once_flag remote_workers_checked;
+
+    //! Sets up the workers listed in `BOB_WORKERS`, if any.
+    void connect_remote_workers() {
+        const char *env = getenv("BOB_WORKERS");
+        if (!env) return;
+        vector<string> hosts;
+        std::istringstream in(env);
+        for (string host; in >> host;) hosts.push_back(host);
+        if (!hosts.empty()) global_remote_workers = std::make_unique<RemoteWorkers>(hosts);
+    }
+
+    RemoteWorkers &use_remote_workers(const vector<string> &hosts, size_t slots) {
+        std::call_once(remote_workers_checked, connect_remote_workers);
+        global_remote_workers = std::make_unique<RemoteWorkers>(hosts, slots);
+        return *global_remote_workers;
+    }
+
+    RemoteWorkers *remote_workers() {
+        std::call_once(remote_workers_checked, connect_remote_workers);
+        return global_remote_workers.get();
+    }
+
+    // Output larger than this is written right away instead of waiting for the next flush
+    const size_t SINK_BUFFER_LIMIT = 64 * 1024;
+
+    OutputSink::OutputSink(int fd) : fd(fd) {
+        const char *term = getenv("TERM");
+        tty = isatty(fd) && !(term && string(term) == "dumb");
+    }
+
+    bool OutputSink::is_tty() const {
+        return tty;
+    }
+
+    void OutputSink::print(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer.append(text);
+        if (buffer.size() > SINK_BUFFER_LIMIT) write_locked();
+    }
+
+    void OutputSink::add_jobs(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total += count;
+    }
+
+    size_t OutputSink::begin_job() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next_job++;
+    }
+
+    // Appends `text` to `out` with every line starting with `prefix`. `line_start` tracks whether the next character starts a line.
+    void append_prefixed(string &out, std::string_view text, const string &prefix, bool line_start) {
+        if (prefix.empty()) {
+            out.append(text);
+            return;
+        }
+        for (char c : text) {
+            if (line_start) out += prefix;
+            out += c;
+            line_start = c == '\n';
+        }
+    }
+
+    void OutputSink::job_output(size_t job, std::string_view chunk, OutputMode mode, const string &prefix) {
+        if (mode == OutputMode::Silent) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        string &rest = pending[job];
+        rest.append(chunk);
+        if (mode != OutputMode::Lines) return;
+
+        // Only complete lines are printed, the rest waits for its end
+        size_t end = rest.rfind('\n');
+        if (end == string::npos) return;
+        append_prefixed(buffer, std::string_view(rest).substr(0, end + 1), prefix, true);
+        rest.erase(0, end + 1);
+        if (buffer.size() > SINK_BUFFER_LIMIT) write_locked();
+    }
+
+    void OutputSink::end_job(size_t job, OutputMode mode, const string &prefix, bool keep) {
+        if (mode == OutputMode::Silent) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pending.find(job);
+        if (it == pending.end()) return;
+        if (keep && !it->second.empty()) {
+            append_prefixed(buffer, it->second, prefix, true);
+            if (it->second.back() != '\n') buffer += '\n';
+        }
+        pending.erase(it);
+    }
+
+    void OutputSink::job_finished(const string &name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done++;
+        status = "[" + std::to_string(done) + "/" + std::to_string(total) + "] " + name;
+    }
+
+    void OutputSink::skip_jobs(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done += count;
+    }
+
+    void OutputSink::flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        write_locked();
+    }
+
+    void OutputSink::write_locked() {
+        // Once every job is done, the status line is removed
+        if (done >= total) {
+            status.clear();
+            done = total = 0;
+        }
+        string line = tty ? status : "";
+        if (!line.empty()) {
+            struct winsize size;
+            if (ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 1 && line.size() >= size.ws_col) {
+                line.resize(size.ws_col - 1);
+            }
+        }
+        if (buffer.empty() && line == shown) return;
+
+        // The status line is cleared, the output written below it and the status drawn again
+        string out;
+        if (!shown.empty()) out += "\r\033[K";
+        out += buffer;
+        out += line;
+        buffer.clear();
+        shown = line;
+
+        // Earlier output of the program must come first
+        std::cout.flush();
+        size_t written = 0;
+        while (written < out.size()) {
+            ssize_t n = write(fd, out.data() + written, out.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            written += n;
+        }
+    }
+
+    OutputSink &output_sink() {
+        // Never destroyed, so commands finishing during exit can still print
+        static OutputSink *sink = new OutputSink();
+        return *sink;
+    }
+
+    //! Returns the available system memory in bytes, or `SIZE_MAX` if it is unknown.
+    size_t available_memory() {
+        std::ifstream meminfo("/proc/meminfo");
+        string key;
+        size_t kb;
+        while (meminfo >> key >> kb) {
+            if (key == "MemAvailable:") return kb * 1024;
+            meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        return SIZE_MAX;
+    }
+
+    int CmdRunner::next_fitting(bool remote_only) const {
+        // Resources held by the running commands
+        size_t running = 0;
+        size_t reserved = 0;
+        std::unordered_map<string, size_t> pool_usage;
+        for (const auto &slot : slots) {
+            if (slot.index < 0 || slot.fut.done) continue;
+            const Cmd &cmd = cmds[slot.index];
+            if (!cmd.pool.empty()) pool_usage[cmd.pool]++;
+            if (slot.worker >= 0) continue;
+            running++;
+            reserved += cmd.memory;
+        }
+
+        for (size_t pos = cursor; pos < schedule.size(); ++pos) {
+            size_t i = schedule[pos];
+            if (started[i]) continue;
+            const Cmd &cmd = cmds[i];
+            if (!cmd.pool.empty()) {
+                auto depth = pool_depths.find(cmd.pool);
+                if (depth != pool_depths.end() && pool_usage[cmd.pool] >= depth->second) continue;
+            }
+            if (remote_only) {
+                if (RemoteWorkers::can_run(cmd)) return (int) i;
+                continue;
+            }
+            if (memory_budget > 0 && running > 0 && reserved + cmd.memory > memory_budget) continue;
+            return (int) i;
+        }
+        return -1;
+    }
+
+    bool CmdRunner::system_free() const {
+        // Never throttle the only running command, so the build keeps making progress
+        bool any_running = false;
+        for (const auto &slot : slots) {
+            if (slot.index >= 0 && !slot.fut.done) any_running = true;
+        }
+        if (!any_running) return true;
+
+        if (load_limit > 0) {
+            double load;
+            if (getloadavg(&load, 1) == 1 && load >= load_limit) return false;
+        }
+        if (free_memory > 0 && available_memory() < free_memory) return false;
+        return true;
+    }
+
+    bool CmdRunner::populate_slots() {
+        // Collect finished commands first, so their resources are free again
+        for (auto &slot : slots) {
+            if (slot.index < 0 || slot.fut.done) continue;
+            if (poll_slot(slot)) set_exit_code(slot);
+        }
+
+        bool did_work = false;
+        throttled = false;
+        straggler_wait_ms = -1;
+        Jobserver *js = jobserver();
+        RemoteWorkers *workers = remote_workers();
+        size_t local = 0;
+        for (const auto &slot : slots) {
+            if (slot.index >= 0 && !slot.fut.done && slot.worker < 0) local++;
+        }
+        for (auto &slot : slots) {
+            if (slot.index >= 0 && !slot.fut.done) continue;
+
+            // Slot is ready!
+
+            if (failure_limit > 0 && failures >= failure_limit) break;
+
+            // Remote workers take hermetic commands once no more commands can start locally
+            bool remote_only = local >= process_count;
+            if (!remote_only && !system_free()) {
+                throttled = true;
+                remote_only = true;
+            }
+            if (remote_only && (!workers || workers->available() == 0)) break;
+            int index = next_fitting(remote_only);
+
+            // With nothing left to start, idle slots race stragglers
+            bool duplicate = false;
+            if (index < 0 && launched == cmds.size() && !remote_only) {
+                index = next_straggler();
+                duplicate = index >= 0;
+            }
+            if (index < 0) break;
+
+            int worker = -1;
+            if (remote_only) {
+                worker = workers->acquire();
+                if (worker < 0) break;
+            } else if (js) {
+                // Wait for a job slot before launching more commands
+                if (!js->try_acquire()) break;
+                slot.token = true;
+            }
+            if (worker < 0) local++;
+
+            // Populate slot with a new command
+            if (!duplicate) {
+                started[index] = true;
+                launched++;
+                while (cursor < schedule.size() && started[schedule[cursor]]) cursor++;
+            }
+            slot.duplicate = duplicate;
+            slot.worker = worker;
+            slot.output.clear();
+            slot.error.clear();
+            const Cmd &cmd = cmds[index];
+            OutputSink &sink = output_sink();
+            string label = output_prefix(index);
+            if (worker >= 0) {
+                string on = "[on " + workers->host(worker) + "] ";
+                Cmd shipped;
+                if (workers->remote(cmd, worker, shipped, slot.staged)) {
+                    if (echoes[index]) sink.print("CMD: " + label + on + cmd.render() + "\n");
+                    slot.fut = shipped.run_async();
+                    if (slot.fut.trace_lane >= 0) slot.fut.trace_name = on + cmd.render();
+                } else {
+                    // Staging failed, so it takes a local slot even when all are busy
+                    WARNING("Could not stage the inputs of " + cmd.render() + " for " + workers->host(worker) + ", running it locally.");
+                    workers->release(worker);
+                    slot.worker = -1;
+                    local++;
+                    if (echoes[index]) sink.print("CMD: " + label + cmd.render() + "\n");
+                    slot.fut = cmd.run_async();
+                }
+            } else {
+                if (echoes[index] && !duplicate) sink.print((cmd.task ? "TASK: " : "CMD: ") + label + cmd.render() + "\n");
+                slot.fut = cmd.run_async();
+            }
+            slot.fut.slot = &slot - slots.data();
+            slot.index = index;
+            slot.job = sink.begin_job();
+            if (mode != OutputMode::Silent) {
+                OutputFunc forward = slot.fut.on_output;
+                size_t job = slot.job;
+                OutputMode output_mode = mode;
+                slot.fut.on_output = [forward, job, output_mode, label](std::string_view chunk) {
+                    output_sink().job_output(job, chunk, output_mode, label);
+                    if (forward) forward(chunk);
+                };
+            }
+
+            did_work = true;
+        }
+        return did_work;
+    }
+
+    void CmdRunner::await_slots() {
+        for (;;) {
+            bool did_work = populate_slots();
+            bool running = false;
+            for (const auto &slot : slots) running |= slot.index >= 0;
+            if (!running && !any_waiting()) {
+                output_sink().flush();
+                return;
+            }
+            if (!did_work) {
+                // Everything printed since the last wait goes out in one write
+                output_sink().flush();
+                wait_slots();
+            }
+        }
+    }
+
+    bool CmdRunner::poll_slot(CmdRunnerSlot &slot) {
+        Cmd &cmd = cmds[slot.index];
+        if (!slot.duplicate) return cmd.poll_future(slot.fut);
+        return slot.fut.poll(&slot.output, cmd.separate_stderr ? &slot.error : nullptr);
+    }
+
+    void CmdRunner::release_slot(CmdRunnerSlot &slot) {
+        if (slot.token) {
+            jobserver()->release();
+            slot.token = false;
+        }
+        if (slot.worker >= 0) {
+            remote_workers()->release(slot.worker);
+            slot.worker = -1;
+        }
+        if (!slot.staged.empty()) {
+            RemoteWorkers::discard(slot.staged);
+            slot.staged.clear();
+        }
+        slot.index = -1;
+        slot.duplicate = false;
+    }
+
+    int CmdRunner::next_straggler() {
+        double now = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        vector<int> copies(cmds.size(), 0);
+        for (const auto &slot : slots) {
+            if (slot.index >= 0 && !slot.fut.done) copies[slot.index]++;
+        }
+        for (const auto &slot : slots) {
+            if (slot.index < 0 || slot.fut.done || copies[slot.index] > 1) continue;
+            if (!cmds[slot.index].speculative || cmds[slot.index].task || history[slot.index] < 0) continue;
+
+            int64_t expected = history[slot.index];
+            double limit = std::max<double>(expected * SPECULATE_FACTOR, expected + SPECULATE_MIN_MS);
+            double started = std::chrono::duration<double, std::milli>(slot.fut.started.time_since_epoch()).count();
+            double remaining = limit - (now - started);
+            if (remaining <= 0) return slot.index;
+            if (straggler_wait_ms < 0 || remaining < straggler_wait_ms) straggler_wait_ms = (int) remaining + 1;
+        }
+        return -1;
+    }
+
+    void CmdRunner::wait_slots() const {
+        vector<const CmdFuture *> futs;
+        bool free_slot = false;
+        for (const auto &slot : slots) {
+            if (slot.index >= 0 && !slot.fut.done) futs.push_back(&slot.fut);
+            else free_slot = true;
+        }
+        // Also wake up when a job slot may have been returned to the jobserver,
+        // and check the system resources again after a while when throttled
+        Jobserver *js = jobserver();
+        int timeout_ms = throttled ? RESOURCE_RECHECK_MS : -1;
+        if (free_slot && straggler_wait_ms >= 0 && (timeout_ms < 0 || straggler_wait_ms < timeout_ms)) timeout_ms = straggler_wait_ms;
+        wait_futures(futs, timeout_ms, js && free_slot && any_waiting() ? js->fd() : -1);
+    }
+
+    //! Key of a command in the build database.
+    string command_key(const Cmd &cmd) {
+        return "cmd " + hex(hash_string(cmd.render()));
+    }
+
+    void CmdRunner::set_exit_code(CmdRunnerSlot &slot) {
+        if (slot.index < 0) {
+            release_slot(slot);
+            return;
+        }
+        size_t index = slot.index;
+        Cmd &cmd = cmds[index];
+
+        // With two copies running, the first one to succeed wins and the other one is killed
+        CmdRunnerSlot *twin = nullptr;
+        for (auto &other : slots) {
+            if (&other != &slot && other.index == (int) index && !other.fut.done) twin = &other;
+        }
+        OutputSink &sink = output_sink();
+        string label = output_prefix(index);
+        if (twin) {
+            if (slot.fut.exit_code != 0) {
+                sink.end_job(slot.job, mode, label, false);
+                release_slot(slot);
+                return;
+            }
+            twin->fut.kill();
+            sink.end_job(twin->job, mode, label, false);
+            release_slot(*twin);
+        }
+        sink.end_job(slot.job, mode, label);
+        if (slot.duplicate) {
+            cmd.output_str = std::move(slot.output);
+            cmd.error_str  = std::move(slot.error);
+        }
+        release_slot(slot);
+
+        if (slot.fut.exit_code != 0 && attempts[index] < cmd.retries) {
+            // Run the command again later
+            attempts[index]++;
+            started[index] = false;
+            launched--;
+            cursor = 0;
+            cmd.output_str.clear();
+            cmd.error_str.clear();
+            return;
+        }
+
+        exit_codes[index] = slot.fut.exit_code;
+        if (slot.fut.exit_code != 0) failures++;
+        finished++;
+        sink.job_finished(cmd.render());
+        stats[index] = slot.fut.stats;
+        cmd.stats = slot.fut.stats;
+
+        if (BuildDb *db = build_db()) {
+            if (!slot.fut.timed_out) db->set_duration(command_key(cmd), (int64_t) slot.fut.stats.wall_ms);
+        }
+    }
+
+    void CmdRunner::plan_schedule() {
+        schedule.resize(cmds.size());
+        for (size_t i = 0; i < cmds.size(); ++i) schedule[i] = i;
+        history.assign(cmds.size(), -1);
+
+        BuildDb *db = build_db();
+        if (!db) return;
+
+        // Commands without history are assumed to take an average amount of time
+        vector<int64_t> expected(cmds.size(), -1);
+        int64_t total = 0, known = 0;
+        for (size_t i = 0; i < cmds.size(); ++i) {
+            if (db->get_duration(command_key(cmds[i]), &expected[i])) {
+                history[i] = expected[i];
+                if (expected[i] < SCHEDULE_MIN_MS) expected[i] = 0;
+                total += expected[i];
+                known++;
+            }
+        }
+        if (known == 0) return;
+        for (auto &ms : expected) if (ms < 0) ms = total / known;
+
+        std::stable_sort(schedule.begin(), schedule.end(), [&](size_t a, size_t b) {
+            return expected[a] > expected[b];
+        });
+    }
+
+    bool CmdRunner::any_waiting() const {
+        if (failure_limit > 0 && failures >= failure_limit) return false;
+        return launched < cmds.size();
+    }
+
+    void CmdRunner::init_slots() {
         for (auto &slot : slots) {
             slot.fut.done = true;
             slot.fut.output_fd = -1;
@@ -1161,154 +4316,2364 @@ namespace bob {
         }
     }
 
-    CmdRunner::CmdRunner(size_t process_count):
-        process_count(process_count),
-        slots(vector<CmdRunnerSlot>(process_count))
-    {
-        init_slots();
-        assert(process_count > 0 && "Process count must be greater than 0");
-    };
+    CmdRunner::CmdRunner(size_t process_count):
+        process_count(process_count),
+        slots(vector<CmdRunnerSlot>(process_count))
+    {
+        init_slots();
+        assert(process_count > 0 && "Process count must be greater than 0");
+    };
+
+    CmdRunner::CmdRunner(vector<Cmd> cmds) :
+        process_count(sysconf(_SC_NPROCESSORS_ONLN)),
+        slots(vector<CmdRunnerSlot>(process_count)),
+        cmds(std::move(cmds))
+    {
+        init_slots();
+        if (process_count == 0) process_count = 1; // Fallback
+    }
+
+    CmdRunner::CmdRunner(vector<Cmd> cmds, size_t process_count) :
+        process_count(process_count),
+        slots(vector<CmdRunnerSlot>(process_count)),
+        cmds(std::move(cmds))
+    {
+        init_slots();
+        if (process_count == 0) process_count = 1; // Fallback
+    }
+
+    CmdRunner::CmdRunner():
+        process_count(sysconf(_SC_NPROCESSORS_ONLN)),
+        slots(vector<CmdRunnerSlot>(process_count))
+    {
+        init_slots();
+        if (process_count == 0) process_count = 1; // Fallback
+    }
+
+    size_t CmdRunner::size() {
+        return cmds.size();
+    }
+
+    void CmdRunner::push(Cmd cmd) {
+        cmd.silent = true;
+        cmds.push_back(std::move(cmd));
+    }
+
+    void CmdRunner::push_many(vector<Cmd> cmds) {
+        this->cmds.reserve(this->cmds.size() + cmds.size());
+        for (auto &cmd : cmds) {
+            push(std::move(cmd));
+        }
+    }
+
+    void CmdRunner::clear() {
+        cmds.clear();
+        exit_codes.clear();
+        stats.clear();
+    }
+
+    bool CmdRunner::run() {
+        exit_codes.resize(cmds.size(), -1);
+        stats.resize(cmds.size());
+        started.assign(cmds.size(), false);
+        plan_schedule();
+        attempts.assign(cmds.size(), 0);
+
+        // Every remote job slot also needs a slot here
+        size_t wanted = process_count + (remote_workers() ? remote_workers()->capacity() : 0);
+        if (slots.size() < wanted) {
+            slots.resize(wanted);
+            init_slots();
+        }
+        cursor = 0;
+        launched = 0;
+        failures = 0;
+        finished = 0;
+
+        // Command lines are printed through the output sink instead of by the commands
+        echoes.resize(cmds.size());
+        for (size_t i = 0; i < cmds.size(); ++i) {
+            echoes[i] = cmds[i].echo;
+            cmds[i].echo = false;
+        }
+        OutputSink &sink = output_sink();
+        sink.add_jobs(cmds.size());
+        await_slots();
+        for (size_t i = 0; i < cmds.size(); ++i) cmds[i].echo = echoes[i];
+        sink.skip_jobs(cmds.size() - finished);
+        sink.flush();
+        return !any_failed();
+    }
+
+    bool CmdRunner::all_succeded() {
+        return !any_failed();
+    }
+
+    bool CmdRunner::any_failed() {
+        for (auto &exit_code : exit_codes) {
+            if (exit_code != 0) return true;
+        }
+        return false;
+    }
+    
+    void CmdRunner::print_failed() {
+        size_t skipped = 0;
+        for (size_t i = 0; i < cmds.size(); ++i) {
+            if (i < started.size() && !started[i]) {
+                skipped++;
+                continue;
+            }
+            if (exit_codes[i] != 0) {
+                std::cerr << term::RED << "[FAILED] " << cmds[i].render() << " (exit code: " << exit_codes[i] << ")" << term::RESET << std::endl;
+                if (!cmds[i].output_str.empty()) {
+                    std::cerr << cmds[i].output_str;
+                }
+            }
+        }
+        if (skipped > 0) {
+            std::cerr << term::YELLOW << "[SKIPPED] " << skipped << " command" << (skipped == 1 ? " was" : "s were")
+                      << " not started after " << failures << " failed." << term::RESET << std::endl;
+        }
+    }
+
+    void CmdRunner::print_stats(size_t count) {
+        auto seconds = [](double ms) {
+            std::ostringstream oss;
+            oss.setf(std::ios::fixed);
+            oss.precision(2);
+            oss << ms / 1000.0 << " s";
+            return oss.str();
+        };
+        auto megabytes = [](long kb) {
+            std::ostringstream oss;
+            oss.setf(std::ios::fixed);
+            oss.precision(1);
+            oss << kb / 1024.0 << " MB";
+            return oss.str();
+        };
+        auto table = [&](const string &title, vector<size_t> indices) {
+            std::cout << term::BOLD << title << term::RESET << std::endl;
+            std::cout << "    " << std::setw(10) << "wall" << std::setw(10) << "cpu" << std::setw(12) << "max rss" << "  command" << std::endl;
+            for (size_t i = 0; i < std::min(count, indices.size()); ++i) {
+                const CmdStats &stat = stats[indices[i]];
+                std::cout << "    " << std::setw(10) << seconds(stat.wall_ms)
+                          << std::setw(10) << seconds(stat.user_ms + stat.sys_ms)
+                          << std::setw(12) << megabytes(stat.max_rss_kb)
+                          << "  " << cmds[indices[i]].render() << std::endl;
+            }
+        };
+
+        vector<size_t> indices;
+        for (size_t i = 0; i < stats.size() && i < cmds.size(); ++i) indices.push_back(i);
+
+        std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return stats[a].wall_ms > stats[b].wall_ms; });
+        table("Slowest commands:", indices);
+        std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return stats[a].max_rss_kb > stats[b].max_rss_kb; });
+        table("Most memory hungry commands:", indices);
+
+        CmdStats total;
+        for (size_t i : indices) {
+            total.wall_ms += stats[i].wall_ms;
+            total.user_ms += stats[i].user_ms;
+            total.sys_ms  += stats[i].sys_ms;
+            total.max_rss_kb    = std::max(total.max_rss_kb, stats[i].max_rss_kb);
+            total.read_blocks  += stats[i].read_blocks;
+            total.write_blocks += stats[i].write_blocks;
+        }
+        std::cout << "Total: " << indices.size() << " commands, " << seconds(total.user_ms) << " user, "
+                  << seconds(total.sys_ms) << " sys, peak " << megabytes(total.max_rss_kb) << ", "
+                  << total.read_blocks << " blocks read, " << total.write_blocks << " blocks written" << std::endl;
+    }
+
+    void CmdRunner::capture_output(bool capture) {
+        for (auto &cmd : cmds) {
+            cmd.capture_output = capture;
+        }
+    }
+
+    void CmdRunner::output_limit(size_t limit) {
+        for (auto &cmd : cmds) {
+            cmd.output_limit = limit;
+        }
+    }
+
+    void CmdRunner::pool(const string &name, size_t depth) {
+        pool_depths[name] = std::max<size_t>(depth, 1);
+    }
+
+    void CmdRunner::max_load(double load) {
+        load_limit = load;
+    }
+
+    void CmdRunner::memory_limit(size_t bytes) {
+        memory_budget = bytes;
+    }
+
+    void CmdRunner::min_free_memory(size_t bytes) {
+        free_memory = bytes;
+    }
+
+    void CmdRunner::keep_going(size_t failures) {
+        failure_limit = failures;
+    }
+
+    void CmdRunner::output(OutputMode mode, bool prefix) {
+        this->mode = mode;
+        this->prefix = prefix;
+    }
+
+    string CmdRunner::output_prefix(size_t index) const {
+        return prefix ? "[" + std::to_string(index + 1) + "] " : "";
+    }
+
+    FileStat to_file_stat(const struct stat &st) {
+        FileStat result;
+        result.exists = true;
+        result.mtime  = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        result.size   = st.st_size;
+        return result;
+    }
+
+    FileStat stat_file(const path &file) {
+        struct stat st;
+        if (::stat(file.c_str(), &st) < 0) return FileStat();
+        return to_file_stat(st);
+    }
+
+    FileStat StatCache::get(const path &file) {
+        string key = file.lexically_normal().string();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(key);
+            if (it != entries.end()) return it->second;
+        }
+        FileStat result = stat_file(file);
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[key] = result;
+        return result;
+    }
+
+    void StatCache::put(const path &file, const FileStat &stat) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[file.lexically_normal().string()] = stat;
+    }
+
+    void StatCache::invalidate(const path &file) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.erase(file.lexically_normal().string());
+    }
+
+    void StatCache::clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+    StatCache &stat_cache() {
+        static StatCache cache;
+        return cache;
+    }
+
+    //! Splits a relative path or pattern into its components, dropping empty and `.` components.
+    vector<string> path_components(std::string_view text) {
+        vector<string> parts;
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('/', start);
+            if (end == string::npos) end = text.size();
+            std::string_view part = text.substr(start, end - start);
+            if (!part.empty() && part != ".") parts.emplace_back(part);
+            start = end + 1;
+        }
+        return parts;
+    }
+
+    bool glob_match_components(const vector<string> &pattern, size_t i, const vector<string> &parts, size_t j) {
+        for (; i < pattern.size(); i++, j++) {
+            if (pattern[i] == "**") {
+                for (size_t k = j; k <= parts.size(); k++) {
+                    if (glob_match_components(pattern, i + 1, parts, k)) return true;
+                }
+                return false;
+            }
+            if (j >= parts.size()) return false;
+            if (fnmatch(pattern[i].c_str(), parts[j].c_str(), 0) != 0) return false;
+        }
+        return j == parts.size();
+    }
+
+    bool glob_match(const string &pattern, const path &file) {
+        return glob_match_components(path_components(pattern), 0, path_components(file.string()), 0);
+    }
+
+    //! A single pattern of a `.gitignore` file.
+    struct IgnoreRule {
+        string base; // Directory of the `.gitignore` file, relative to the scanned root
+        vector<string> pattern;
+        bool negate   = false;
+        bool dir_only = false;
+        bool anchored = false;
+    };
+
+    typedef std::shared_ptr<const vector<IgnoreRule>> IgnoreRules;
+
+    void parse_ignore_line(string line, const string &base, vector<IgnoreRule> &rules) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.empty() || line[0] == '#') return;
+        IgnoreRule rule;
+        rule.base = base;
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.erase(0, 1);
+        }
+        if (!line.empty() && line[0] == '\\') line.erase(0, 1);
+        if (!line.empty() && line.back() == '/') {
+            rule.dir_only = true;
+            line.pop_back();
+        }
+        // A slash at the start or in the middle anchors the pattern to the directory of the `.gitignore`
+        rule.anchored = line.find('/') != string::npos;
+        rule.pattern  = path_components(line);
+        if (rule.pattern.empty()) return;
+        rules.push_back(std::move(rule));
+    }
+
+    IgnoreRules read_ignore_file(const path &file, const string &base, const IgnoreRules &rules) {
+        std::ifstream in(file);
+        if (!in.is_open()) return rules;
+        auto result = std::make_shared<vector<IgnoreRule>>(*rules);
+        string line;
+        while (std::getline(in, line)) parse_ignore_line(line, base, *result);
+        return result;
+    }
+
+    bool is_ignored(const IgnoreRules &rules, const string &rel, const char *name, bool is_dir) {
+        // The last matching rule decides. Ignored directories are not entered,
+        // so only the name has to be checked against unanchored patterns.
+        bool ignored = false;
+        for (const IgnoreRule &rule : *rules) {
+            if (rule.negate != ignored) continue;
+            if (rule.dir_only && !is_dir) continue;
+            bool match;
+            if (rule.anchored) {
+                std::string_view sub = rel;
+                if (!rule.base.empty()) {
+                    if (rel.size() <= rule.base.size() || rel.compare(0, rule.base.size(), rule.base) != 0
+                        || rel[rule.base.size()] != '/') continue;
+                    sub.remove_prefix(rule.base.size() + 1);
+                }
+                match = glob_match_components(rule.pattern, 0, path_components(sub), 0);
+            } else {
+                match = fnmatch(rule.pattern[0].c_str(), name, 0) == 0;
+            }
+            if (match) ignored = !rule.negate;
+        }
+        return ignored;
+    }
+
+    //! Scans the directories below `root / start`, where `start` is relative to the root.
+    vector<ScanEntry> scan_from(const path &root, const string &start, const ScanOptions &options) {
+        struct Dir {
+            string      rel;
+            IgnoreRules rules;
+        };
+
+        auto base_rules = std::make_shared<vector<IgnoreRule>>();
+        for (const string &line : options.ignore) parse_ignore_line(line, "", *base_rules);
+        IgnoreRules rules = base_rules;
+
+        // Honour the `.gitignore` files in the directories leading up to the start directory
+        if (options.gitignore) {
+            string rel;
+            for (const string &part : path_components(start)) {
+                rules = read_ignore_file(root / rel / ".gitignore", rel, rules);
+                rel = rel.empty() ? part : rel + "/" + part;
+            }
+        }
+
+        vector<vector<string>> compiled;
+        for (const string &pattern : options.patterns) compiled.push_back(path_components(pattern));
+
+        // Without `**`, no file below the components of the longest pattern can match, so deeper
+        // directories are never opened
+        size_t max_depth = compiled.empty() ? SIZE_MAX : 0;
+        for (const vector<string> &pattern : compiled) {
+            bool recursive = std::find(pattern.begin(), pattern.end(), "**") != pattern.end();
+            max_depth = std::max(max_depth, recursive ? SIZE_MAX : pattern.size());
+        }
+
+        size_t threads = options.threads;
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        vector<Dir> pending = {{start, rules}};
+        size_t busy = 0;
+        vector<vector<ScanEntry>> found(threads);
+
+        auto scan_dir = [&](const Dir &dir, vector<ScanEntry> &entries) {
+            path dir_path = dir.rel.empty() ? root : root / dir.rel;
+            int fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) return;
+            DIR *handle = fdopendir(fd);
+            if (handle == nullptr) {
+                close(fd);
+                return;
+            }
+
+            IgnoreRules rules = dir.rules;
+            if (options.gitignore) rules = read_ignore_file(dir_path / ".gitignore", dir.rel, rules);
+
+            vector<Dir> subdirs;
+            while (struct dirent *ent = readdir(handle)) {
+                const char *name = ent->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0) continue;
+
+                // Symbolic links to directories are skipped, so links can never form a cycle
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                if (S_ISLNK(st.st_mode) && (fstatat(fd, name, &st, 0) < 0 || S_ISDIR(st.st_mode))) continue;
+
+                string rel = dir.rel.empty() ? string(name) : dir.rel + "/" + name;
+                bool is_dir = S_ISDIR(st.st_mode);
+                if (is_ignored(rules, rel, name, is_dir)) continue;
+
+                if (is_dir) {
+                    size_t depth = std::count(rel.begin(), rel.end(), '/') + 1;
+                    if (depth < max_depth) subdirs.push_back({std::move(rel), rules});
+                    continue;
+                }
+
+                if (!compiled.empty()) {
+                    vector<string> parts = path_components(rel);
+                    bool match = false;
+                    for (const vector<string> &pattern : compiled) {
+                        if (glob_match_components(pattern, 0, parts, 0)) {
+                            match = true;
+                            break;
+                        }
+                    }
+                    if (!match) continue;
+                }
+
+                ScanEntry entry = {(root / rel).lexically_normal(), to_file_stat(st)};
+                stat_cache().put(entry.file, entry.stat);
+                entries.push_back(std::move(entry));
+            }
+            closedir(handle);
+
+            if (subdirs.empty()) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Dir &subdir : subdirs) pending.push_back(std::move(subdir));
+            cv.notify_all();
+        };
+
+        auto worker = [&](size_t index) {
+            while (true) {
+                Dir dir;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return !pending.empty() || busy == 0; });
+                    if (pending.empty()) return;
+                    dir = std::move(pending.back());
+                    pending.pop_back();
+                    busy++;
+                }
+                scan_dir(dir, found[index]);
+                std::lock_guard<std::mutex> lock(mutex);
+                busy--;
+                if (busy == 0 && pending.empty()) cv.notify_all();
+            }
+        };
+
+        vector<std::thread> pool;
+        for (size_t i = 1; i < threads; i++) pool.emplace_back(worker, i);
+        worker(0);
+        for (std::thread &thread : pool) thread.join();
+
+        vector<ScanEntry> result;
+        for (vector<ScanEntry> &entries : found) {
+            for (ScanEntry &entry : entries) result.push_back(std::move(entry));
+        }
+        std::sort(result.begin(), result.end(), [](const ScanEntry &a, const ScanEntry &b) {
+            return a.file < b.file;
+        });
+        return result;
+    }
+
+    vector<ScanEntry> scan(const path &root, const ScanOptions &options) {
+        return scan_from(root, "", options);
+    }
+
+    Paths glob(const string &pattern, const path &root) {
+        // Only scan below the components without wildcards
+        vector<string> parts = path_components(pattern);
+        string start;
+        for (size_t i = 0; i + 1 < parts.size(); i++) {
+            if (parts[i].find_first_of("*?[") != string::npos) break;
+            start = start.empty() ? parts[i] : start + "/" + parts[i];
+        }
+        ScanOptions options;
+        options.patterns = {pattern};
+        Paths result;
+        for (ScanEntry &entry : scan_from(root, start, options)) result.push_back(std::move(entry.file));
+        return result;
+    }
+
+    uint64_t hash_string(std::string_view data, uint64_t hash) {
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    uint64_t hash_file(const path &file) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in.is_open()) return 0;
+        uint64_t hash = hash_string("");
+        vector<char> buf(1 << 16);
+        while (in) {
+            in.read(buf.data(), buf.size());
+            hash = hash_string(std::string_view(buf.data(), in.gcount()), hash);
+        }
+        return hash;
+    }
+
+    const string BUILD_DB_HEADER = "bob-db 1";
+
+    BuildDb::BuildDb(path file) : file(file) {
+        load();
+    }
+
+    BuildDb::~BuildDb() {
+        save();
+    }
+
+    void BuildDb::load() {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.clear();
+        signatures.clear();
+        deps.clear();
+        durations.clear();
+        dirty = false;
+
+        std::ifstream in(file);
+        if (!in.is_open()) return;
+
+        string line;
+        if (!std::getline(in, line) || line != BUILD_DB_HEADER) {
+            WARNING("Ignoring build database with unknown format: " + file.string());
+            return;
+        }
+
+        // Lines are `F <mtime> <size> <hash> <path>`, `S <command> <content> <key>`, `T <ms> <key>`,
+        // or `D <output>` followed by a `d <dependency>` line for each of its dependencies.
+        // The path or key is last since it may contain spaces.
+        Paths *current_deps = nullptr;
+        while (std::getline(in, line)) {
+            if (line.size() > 2 && line[0] == 'D' && line[1] == ' ') {
+                current_deps = &deps[line.substr(2)];
+                current_deps->clear();
+                continue;
+            }
+            if (line.size() > 2 && line[0] == 'd' && line[1] == ' ') {
+                if (current_deps) current_deps->push_back(line.substr(2));
+                continue;
+            }
+
+            std::istringstream iss(line);
+            char kind = 0;
+            iss >> kind;
+            if (kind == 'F') {
+                FileEntry entry;
+                iss >> entry.mtime >> entry.size >> std::hex >> entry.hash >> std::ws;
+                string name;
+                std::getline(iss, name);
+                if (iss.fail() || name.empty()) continue;
+                files[name] = entry;
+            } else if (kind == 'S') {
+                Signature sig;
+                iss >> std::hex >> sig.command >> sig.content >> std::ws;
+                string key;
+                std::getline(iss, key);
+                if (iss.fail() || key.empty()) continue;
+                signatures[key] = sig;
+            } else if (kind == 'T') {
+                int64_t ms;
+                iss >> ms >> std::ws;
+                string key;
+                std::getline(iss, key);
+                if (iss.fail() || key.empty()) continue;
+                durations[key] = ms;
+            }
+        }
+    }
+
+    void BuildDb::save() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!dirty) return;
+
+        // Saved from the destructor as well, so failures are only warned about and never throw
+        std::error_code ec;
+        if (file.has_parent_path()) fs::create_directories(file.parent_path(), ec);
+
+        // Write to a temporary file first so an interrupted save never corrupts the database. Its name
+        // is unique, so two builds saving the same database never write to the same file.
+        path tmp = temp_path(file);
+        {
+            std::ofstream out(tmp);
+            if (!out.is_open()) {
+                WARNING("Could not write build database: " + tmp.string());
+                return;
+            }
+            out << BUILD_DB_HEADER << "\n";
+            for (const auto &[name, entry] : files) {
+                out << "F " << entry.mtime << " " << entry.size << " " << std::hex << entry.hash << std::dec << " " << name << "\n";
+            }
+            for (const auto &[key, sig] : signatures) {
+                out << "S " << std::hex << sig.command << " " << sig.content << std::dec << " " << key << "\n";
+            }
+            for (const auto &[key, ms] : durations) {
+                out << "T " << ms << " " << key << "\n";
+            }
+            for (const auto &[output, dependencies] : deps) {
+                out << "D " << output << "\n";
+                for (const auto &dependency : dependencies) out << "d " << dependency.string() << "\n";
+            }
+            out.close();
+            if (out.fail()) {
+                WARNING("Could not write build database: " + tmp.string());
+                fs::remove(tmp, ec);
+                return;
+            }
+        }
+        fs::rename(tmp, file, ec);
+        if (ec) {
+            WARNING("Could not save build database to " + file.string() + ": " + ec.message());
+            fs::remove(tmp, ec);
+            return;
+        }
+        dirty = false;
+    }
+
+    uint64_t BuildDb::hash(const path &target) {
+        FileStat stat = stat_cache().get(target);
+        if (!stat.exists) return 0;
+
+        string key = target.lexically_normal().string();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = files.find(key);
+            if (it != files.end() && it->second.mtime == stat.mtime && it->second.size == stat.size) {
+                return it->second.hash;
+            }
+        }
+
+        uint64_t result = hash_file(target);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        files[key] = FileEntry{stat.mtime, stat.size, result};
+        dirty = true;
+        return result;
+    }
+
+    bool BuildDb::get_signature(const string &key, uint64_t *command, uint64_t *content) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = signatures.find(key);
+        if (it == signatures.end()) return false;
+        *command = it->second.command;
+        *content = it->second.content;
+        return true;
+    }
+
+    void BuildDb::set_signature(const string &key, uint64_t command, uint64_t content) {
+        std::lock_guard<std::mutex> lock(mutex);
+        signatures[key] = Signature{command, content};
+        dirty = true;
+    }
+
+    bool BuildDb::get_deps(const path &output, Paths *result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = deps.find(output.lexically_normal().string());
+        if (it == deps.end()) return false;
+        *result = it->second;
+        return true;
+    }
+
+    void BuildDb::set_deps(const path &output, const Paths &dependencies) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Paths &entry = deps[output.lexically_normal().string()];
+        if (entry == dependencies) return;
+        entry = dependencies;
+        dirty = true;
+    }
+
+    bool BuildDb::get_duration(const string &key, int64_t *ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = durations.find(key);
+        if (it == durations.end()) return false;
+        *ms = it->second;
+        return true;
+    }
+
+    void BuildDb::set_duration(const string &key, int64_t ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        durations[key] = ms;
+        dirty = true;
+    }
+
+    std::unique_ptr<BuildDb> global_build_db = nullptr;
+
+    BuildDb &use_build_db(path dir) {
+        if (!global_build_db) global_build_db = std::make_unique<BuildDb>(dir / "db");
+        return *global_build_db;
+    }
+
+    BuildDb *build_db() {
+        return global_build_db.get();
+    }
+
+    Paths parse_depfile(const path &depfile) {
+        std::ifstream in(depfile);
+        if (!in.is_open()) return {};
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        string content = buffer.str();
+
+        Paths result;
+        string word;
+        bool in_deps = false; // Past the `:` of the current rule
+
+        auto finish_word = [&]() {
+            if (word.empty()) return;
+            if (in_deps) result.push_back(word);
+            word.clear();
+        };
+
+        for (size_t i = 0; i < content.size(); ++i) {
+            char c = content[i];
+            if (c == '\\' && i + 1 < content.size()) {
+                char next = content[i + 1];
+                if (next == '\n' || next == '\r') {             // Line continuation
+                    finish_word();
+                    if (next == '\r' && i + 2 < content.size() && content[i + 2] == '\n') i++;
+                    i++;
+                    continue;
+                }
+                if (next == ' ' || next == '#' || next == '\\') { // Escaped character
+                    word += next;
+                    i++;
+                    continue;
+                }
+            }
+            if (c == '$' && i + 1 < content.size() && content[i + 1] == '$') {
+                word += '$';
+                i++;
+                continue;
+            }
+            if (c == ':' && !in_deps && (i + 1 >= content.size() || isspace((unsigned char) content[i + 1]))) {
+                word.clear(); // Target name
+                in_deps = true;
+                continue;
+            }
+            if (c == '\n') {
+                finish_word();
+                in_deps = false; // Each rule ends at an unescaped newline
+                continue;
+            }
+            if (isspace((unsigned char) c)) {
+                finish_word();
+                continue;
+            }
+            word += c;
+        }
+        finish_word();
+
+        // Remove duplicates, e.g. from `-MP`
+        Paths unique;
+        for (const auto &dep : result) {
+            if (std::find(unique.begin(), unique.end(), dep) == unique.end()) unique.push_back(dep);
+        }
+        return unique;
+    }
+
+    Paths parse_show_includes(const string &output) {
+        const string PREFIX = "Note: including file:";
+        Paths result;
+        std::istringstream iss(output);
+        for (string line; std::getline(iss, line);) {
+            if (line.rfind(PREFIX, 0) != 0) continue;
+            size_t start = line.find_first_not_of(' ', PREFIX.size());
+            size_t end = line.find_last_not_of(" \r");
+            if (start == string::npos || end < start) continue;
+            path include = line.substr(start, end - start + 1);
+            if (std::find(result.begin(), result.end(), include) == result.end()) result.push_back(include);
+        }
+        return result;
+    }
+
+    void record_deps(const path &output, const Paths &dependencies) {
+        BuildDb *db = build_db();
+        if (db) db->set_deps(output, dependencies);
+    }
+
+    path depfile_path(const path &output) {
+        path result = output;
+        return result.replace_extension(".d");
+    }
+
+    // Content hash of a file, using the build database when it is enabled
+    uint64_t content_of(const path &file) {
+        BuildDb *db = build_db();
+        return db ? db->hash(file) : hash_file(file);
+    }
+
+    ArtifactCache::ArtifactCache(path dir, string remote) : dir(dir), remote(remote) {}
+
+    bool ArtifactCache::download(const string &name, const path &target) {
+        if (remote.empty()) return false;
+        std::error_code ec;
+        fs::create_directories(target.parent_path(), ec);
+        Cmd curl({"curl", "-sfL", "-o", target.string(), remote + "/" + name});
+        curl.silent = true;
+        curl.echo = false;
+        if (curl.run() == 0) return true;
+        fs::remove(target, ec);
+        return false;
+    }
+
+    void ArtifactCache::upload(const path &source, const string &name) {
+        if (remote.empty()) return;
+        Cmd curl({"curl", "-sf", "-T", source.string(), remote + "/" + name});
+        curl.silent = true;
+        curl.echo = false;
+        if (curl.run() != 0) WARNING("Could not upload '" + name + "' to the remote artifact cache.");
+    }
+
+    uint64_t ArtifactCache::tool_hash(const string &tool) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = tool_hashes.find(tool);
+            if (it != tool_hashes.end()) return it->second;
+        }
+        path bin = tool.find('/') == string::npos ? search_path(tool) : path(tool);
+        uint64_t result = bin.empty() ? 0 : content_of(bin);
+        std::lock_guard<std::mutex> lock(mutex);
+        tool_hashes[tool] = result;
+        return result;
+    }
+
+    // First line of a manifest, so an empty or foreign file is never taken for an empty dependency list
+    const string MANIFEST_HEADER = "bob-deps 1";
+
+    bool ArtifactCache::get_manifest(const string &key, Paths *deps) {
+        path manifest = dir / (key + ".deps");
+        if (!fs::exists(manifest) && !download(key + ".deps", manifest)) return false;
+        std::ifstream in(manifest);
+        string line;
+        if (!std::getline(in, line) || line != MANIFEST_HEADER) return false;
+        deps->clear();
+        while (std::getline(in, line)) {
+            if (!line.empty()) deps->push_back(line);
+        }
+        return true;
+    }
+
+    bool ArtifactCache::put_manifest(const string &key, const Paths &deps) {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        path manifest = dir / (key + ".deps");
+        path tmp = temp_path(manifest);
+        {
+            std::ofstream out(tmp);
+            out << MANIFEST_HEADER << "\n";
+            for (const auto &dep : deps) out << dep.string() << "\n";
+            out.close();
+            if (out.fail()) {
+                WARNING("Could not write dependency manifest: " + tmp.string());
+                fs::remove(tmp, ec);
+                return false;
+            }
+        }
+        fs::rename(tmp, manifest, ec);
+        if (ec) {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        upload(manifest, key + ".deps");
+        return true;
+    }
+
+    bool ArtifactCache::restore(const string &key, const Paths &files) {
+        std::error_code ec;
+        path entry = dir / key;
+        if (!fs::exists(entry, ec)) {
+            // Download into a temporary directory, so a partial download is never used
+            path tmp = temp_path(entry);
+            bool complete = download(key + "/modes", tmp / "modes");
+            for (size_t i = 0; i < files.size() && complete; ++i) {
+                complete = download(key + "/" + std::to_string(i), tmp / std::to_string(i));
+            }
+            if (!complete) {
+                fs::remove_all(tmp, ec);
+                return false;
+            }
+            fs::rename(tmp, entry, ec);
+            if (ec) fs::remove_all(tmp, ec);
+        }
+
+        // File permissions are stored separately, since they do not survive the remote cache
+        vector<unsigned> modes;
+        {
+            std::ifstream in(entry / "modes");
+            for (unsigned mode; in >> std::oct >> mode;) modes.push_back(mode);
+        }
+        if (modes.size() != files.size()) return false;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (!fs::exists(entry / std::to_string(i), ec)) return false;
+        }
+
+        // Each file is copied next to its output and renamed over it, which also replaces read-only outputs
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].has_parent_path()) fs::create_directories(files[i].parent_path(), ec);
+            path tmp = temp_path(files[i]);
+            fs::copy_file(entry / std::to_string(i), tmp, fs::copy_options::overwrite_existing, ec);
+            if (!ec) fs::permissions(tmp, static_cast<fs::perms>(modes[i]), ec);
+            if (!ec) fs::rename(tmp, files[i], ec);
+            stat_cache().invalidate(files[i]);
+            if (ec) {
+                std::error_code ignored;
+                fs::remove(tmp, ignored);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void ArtifactCache::store(const string &key, const Paths &files) {
+        std::error_code ec;
+        path entry = dir / key;
+        if (fs::exists(entry, ec)) return;
+
+        path tmp = temp_path(entry);
+        fs::create_directories(tmp, ec);
+        {
+            std::ofstream modes(tmp / "modes");
+            for (size_t i = 0; i < files.size() && !ec; ++i) {
+                fs::copy_file(files[i], tmp / std::to_string(i), fs::copy_options::overwrite_existing, ec);
+                fs::file_status status;
+                if (!ec) status = fs::status(files[i], ec);
+                if (!ec) modes << std::oct << static_cast<unsigned>(status.permissions()) << "\n";
+            }
+            modes.close();
+            if (!ec && modes.fail()) ec = std::make_error_code(std::errc::io_error);
+        }
+        if (ec) {
+            WARNING("Could not store artifacts in the cache: " + ec.message());
+            fs::remove_all(tmp, ec);
+            return;
+        }
+
+        // Another build may have stored the same artifacts in the meantime
+        fs::rename(tmp, entry, ec);
+        if (ec) {
+            fs::remove_all(tmp, ec);
+            return;
+        }
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            upload(entry / std::to_string(i), key + "/" + std::to_string(i));
+        }
+        upload(entry / "modes", key + "/modes");
+    }
+
+    std::unique_ptr<ArtifactCache> global_artifact_cache = nullptr;
+
+    ArtifactCache &use_artifact_cache(path dir, string remote) {
+        if (!global_artifact_cache) global_artifact_cache = std::make_unique<ArtifactCache>(dir, remote);
+        return *global_artifact_cache;
+    }
+
+    ArtifactCache *artifact_cache() {
+        return global_artifact_cache.get();
+    }
+
+    // Run a recipe command template for the given inputs and outputs
+    void run_recipe_cmd(const Recipe &recipe, const Paths &inputs, const Paths &outputs) {
+        if (!recipe.mapped) {
+            recipe.command(inputs, outputs).check();
+            return;
+        }
+        CmdRunner runner;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            runner.push(recipe.command({inputs[i]}, {outputs[i]}));
+        }
+        if (!runner.run()) {
+            runner.print_failed();
+            PANIC("Recipe commands failed.");
+        }
+    }
+
+    Recipe::Recipe(const Paths &outputs, const Paths &inputs, RecipeFunc func)
+            : inputs(inputs), outputs(outputs), func(func) {}
+
+    Recipe::Recipe(const Paths &outputs, const Paths &inputs, const Cmd &cmd)
+            : inputs(inputs), outputs(outputs), func(nullptr), cmd(cmd) {}
+
+    Recipe Recipe::map(const Paths &outputs, const Paths &inputs, RecipeFunc func) {
+        if (outputs.size() != inputs.size()) {
+            PANIC("Mapped recipe needs the same number of inputs and outputs.");
+        }
+        Recipe recipe(outputs, inputs, func);
+        recipe.mapped = true;
+        return recipe;
+    }
+
+    Recipe Recipe::map(const Paths &outputs, const Paths &inputs, const Cmd &cmd) {
+        if (outputs.size() != inputs.size()) {
+            PANIC("Mapped recipe needs the same number of inputs and outputs.");
+        }
+        Recipe recipe(outputs, inputs, cmd);
+        recipe.mapped = true;
+        return recipe;
+    }
+
+    Cmd Recipe::command(const Paths &inputs, const Paths &outputs) const {
+        auto substitute = [&inputs, &outputs](const Cmd &stage) {
+            Cmd result = stage;
+            result.clear();
+            for (const string &part : stage.get_parts()) {
+                if      (part == "_INPUTS_")  for (const auto &input : inputs)   result.push(input.string());
+                else if (part == "_OUTPUTS_") for (const auto &output : outputs) result.push(output.string());
+                else                          result.push(part);
+            }
+            return result;
+        };
+        Cmd result = substitute(cmd);
+        // Every stage of a pipeline template gets the inputs and outputs as well
+        if (!cmd.get_stages().empty()) {
+            Cmd pipeline = substitute(cmd.get_stages()[0]);
+            for (size_t i = 1; i < cmd.get_stages().size(); i++) pipeline = pipeline | substitute(cmd.get_stages()[i]);
+            result = pipeline | result;
+            result.stdin_file = cmd.stdin_file;
+        }
+        if (result.hermetic) {
+            result.inputs  = dependencies(inputs, outputs);
+            result.outputs = outputs;
+            if (depfiles) {
+                BuildDb *db = build_db();
+                for (const auto &output : outputs) {
+                    // Without a depfile from an earlier build, the headers are unknown and it has to run locally
+                    Paths deps;
+                    if (!(db && db->get_deps(output, &deps)) && !stat_cache().get(depfile_path(output)).exists) {
+                        result.hermetic = false;
+                    }
+                    result.outputs.push_back(depfile_path(output));
+                }
+            }
+        }
+        return result;
+    }
+
+    // Key identifying a set of outputs in the build database
+    string outputs_key(const Paths &outputs) {
+        uint64_t hash = hash_string("");
+        for (const auto &output : outputs) {
+            hash = hash_string(output.lexically_normal().string(), hash);
+            hash = hash_string("\n", hash);
+        }
+        std::ostringstream oss;
+        oss << std::hex << hash;
+        return oss.str();
+    }
+
+    uint64_t hash_u64(uint64_t value, uint64_t hash) {
+        return hash_string(std::string_view(reinterpret_cast<const char *>(&value), sizeof(value)), hash);
+    }
+
+    uint64_t Recipe::command_hash(const Paths &inputs, const Paths &outputs) const {
+        if (cmd.get_parts().empty()) return 0;
+        return hash_string(command(inputs, outputs).render());
+    }
+
+    uint64_t Recipe::content_hash(BuildDb &db, const Paths &inputs, const Paths &outputs) const {
+        uint64_t hash = hash_string("");
+        for (const auto &input : inputs) {
+            hash = hash_string(input.lexically_normal().string(), hash);
+            hash = hash_u64(db.hash(input), hash);
+        }
+        hash = hash_string("\n->\n", hash);
+        for (const auto &output : outputs) {
+            hash = hash_string(output.lexically_normal().string(), hash);
+            hash = hash_u64(db.hash(output), hash);
+        }
+        return hash;
+    }
+
+    Paths Recipe::all_dependencies() const {
+        return dependencies(inputs, outputs);
+    }
+
+    Paths Recipe::dependencies(const Paths &inputs, const Paths &outputs) const {
+        Paths result = inputs;
+        BuildDb *db = build_db();
+        for (const auto &output : outputs) {
+            Paths deps;
+            if (db && db->get_deps(output, &deps)) {}
+            else if (depfiles) deps = parse_depfile(depfile_path(output));
+            for (auto &dep : deps) {
+                if (std::find(result.begin(), result.end(), dep) == result.end()) result.push_back(dep);
+            }
+        }
+        return result;
+    }
+
+    uint64_t Recipe::cache_base_hash(ArtifactCache &cache, const Paths &inputs, const Paths &outputs) const {
+        Cmd rendered = command(inputs, outputs);
+        uint64_t hash = hash_string("bob-artifact 1\n");
+        hash = hash_string(rendered.render(), hash);
+        hash = hash_string(rendered.root.lexically_normal().string() + "\n", hash);
+        hash = hash_u64(cache.tool_hash(rendered.get_parts()[0]), hash);
+        for (const auto &input : inputs) {
+            hash = hash_string(input.lexically_normal().string(), hash);
+            hash = hash_u64(content_of(input), hash);
+        }
+        hash = hash_string("\n->\n", hash);
+        for (const auto &output : outputs) hash = hash_string(output.lexically_normal().string() + "\n", hash);
+        return hash;
+    }
+
+    bool Recipe::cache_key(ArtifactCache &cache, const Paths &inputs, const Paths &outputs, string *key) const {
+        uint64_t hash = cache_base_hash(cache, inputs, outputs);
+
+        if (!depfiles) {
+            *key = hex(hash);
+            return true;
+        }
+
+        // The included headers are only known from an earlier build, which stored them in a manifest
+        Paths deps;
+        if (!cache.get_manifest(hex(hash), &deps)) return false;
+        for (const auto &dep : deps) {
+            if (!stat_cache().get(dep).exists) return false;
+            hash = hash_string(dep.string(), hash);
+            hash = hash_u64(content_of(dep), hash);
+        }
+        *key = hex(hash);
+        return true;
+    }
+
+    Paths Recipe::artifacts(const Paths &outputs) const {
+        Paths result = outputs;
+        if (depfiles) {
+            for (const auto &output : outputs) result.push_back(depfile_path(output));
+        }
+        return result;
+    }
+
+    bool Recipe::restore_cached(const Paths &inputs, const Paths &outputs) const {
+        ArtifactCache *cache = artifact_cache();
+        if (!cache || cmd.get_parts().empty()) return false;
+
+        string key;
+        if (!cache_key(*cache, inputs, outputs, &key)) return false;
+        if (!cache->restore(key, artifacts(outputs))) return false;
+
+        std::cout << "CACHED: " << command(inputs, outputs).render() << std::endl;
+        return true;
+    }
+
+    void Recipe::store_cached(const Paths &inputs, const Paths &outputs) const {
+        ArtifactCache *cache = artifact_cache();
+        if (!cache || cmd.get_parts().empty()) return;
+
+        Paths files = artifacts(outputs);
+        for (const auto &file : files) {
+            if (!stat_cache().get(file).exists) return;
+        }
+
+        if (depfiles) {
+            // Store the dependency manifest first, so the full key can be computed
+            Paths deps;
+            for (const auto &output : outputs) {
+                for (const auto &dep : parse_depfile(depfile_path(output))) deps.push_back(dep);
+            }
+            if (!cache->put_manifest(hex(cache_base_hash(*cache, inputs, outputs)), deps)) return;
+        }
+
+        string key;
+        if (!cache_key(*cache, inputs, outputs, &key)) return;
+        cache->store(key, files);
+    }
+
+    void Recipe::record(const Paths &inputs, const Paths &outputs) const {
+        BuildDb *db = build_db();
+        if (!db) return;
+        Paths all_inputs = dependencies(inputs, outputs);
+        db->set_signature(outputs_key(outputs), command_hash(inputs, outputs), content_hash(*db, all_inputs, outputs));
+    }
+
+    bool Recipe::is_stale(const Paths &inputs, const Paths &outputs) const {
+        StatCache &cache = stat_cache();
+        Paths all_inputs = dependencies(inputs, outputs);
+
+        // Every output depends on every input, so only the newest input and oldest output matter
+        bool mtime_stale = false;
+        int64_t newest_input = INT64_MIN;
+        for (const auto &input : all_inputs) {
+            FileStat stat = cache.get(input);
+            if (!stat.exists) return true;
+            newest_input = std::max(newest_input, stat.mtime);
+        }
+        for (const auto &output : outputs) {
+            FileStat stat = cache.get(output);
+            if (!stat.exists) return true;
+            if (!inputs.empty() && stat.mtime < newest_input) mtime_stale = true;
+        }
+
+        BuildDb *db = build_db();
+        if (!db) return mtime_stale;
+
+        uint64_t command, content;
+        if (!db->get_signature(outputs_key(outputs), &command, &content)) {
+            // Nothing recorded yet. Trust the modification times, and remember the current state if it is up to date.
+            if (!mtime_stale) record(inputs, outputs);
+            return mtime_stale;
+        }
+
+        if (command != command_hash(inputs, outputs)) return true;
+        if (!mtime_stale) return false;
+
+        // Modification times changed. Only rebuild if the content did too.
+        return content != content_hash(*db, all_inputs, outputs);
+    }
+
+    vector<size_t> Recipe::stale() const {
+        vector<size_t> result;
+
+        if (mapped) {
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                if (is_stale({inputs[i]}, {outputs[i]})) result.push_back(i);
+            }
+            return result;
+        }
+
+        if (is_stale(inputs, outputs)) {
+            for (size_t i = 0; i < outputs.size(); ++i) result.push_back(i);
+        }
+        return result;
+    }
+
+    bool Recipe::needs_rebuild() const {
+        return !stale().empty();
+    }
+
+    void Recipe::build() const {
+        StatCache &cache = stat_cache();
+        {
+            vector<bool> exists(inputs.size(), true);
+            bool any_missing = false;
+            for (int i = 0; i < inputs.size(); ++i) {
+                if (!cache.get(inputs[i]).exists) {
+                    exists[i] = false;
+                    any_missing = true;
+                }
+            }
+            if (any_missing) {
+                std::cerr << "[ERROR] Recipe inputs are missing:" << std::endl;
+                vector<string> input_strings;
+                for (auto &input : inputs) input_strings.push_back(input.string());
+                checklist(input_strings, exists);
+                if (build_error_scopes > 0) throw BuildError("Recipe inputs are missing.");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        Tracer *t = tracer();
+        string trace_name = "";
+        if (t && !outputs.empty()) {
+            trace_name = outputs[0].string();
+            if (outputs.size() > 1) trace_name += " (+" + std::to_string(outputs.size() - 1) + ")";
+        }
+
+        int64_t check_start = t ? t->now() : 0;
+        vector<size_t> indices = stale();
+        if (t) t->span(trace_name, "check", check_start, t->now(), Tracer::RECIPES, trace_thread_lane(),
+                       "\"stale\":" + std::to_string(indices.size()));
+        if (indices.empty()) return;
+
+        // Pairs restored from the artifact cache do not need to be built
+        Paths stale_inputs, stale_outputs;
+        Paths done_inputs, done_outputs;
+        if (mapped) {
+            for (size_t i : indices) {
+                bool restored = restore_cached({inputs[i]}, {outputs[i]});
+                (restored ? done_inputs  : stale_inputs).push_back(inputs[i]);
+                (restored ? done_outputs : stale_outputs).push_back(outputs[i]);
+            }
+        } else if (restore_cached(inputs, outputs)) {
+            done_inputs  = inputs;
+            done_outputs = outputs;
+        } else {
+            stale_inputs  = inputs;
+            stale_outputs = outputs;
+        }
+
+        if (!stale_outputs.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            int64_t trace_start = t ? t->now() : 0;
+            if (func) func(stale_inputs, stale_outputs);
+            else      run_recipe_cmd(*this, stale_inputs, stale_outputs);
+            if (t) t->span(trace_name, "build", trace_start, t->now(), Tracer::RECIPES, trace_thread_lane(),
+                           "\"outputs\":" + std::to_string(stale_outputs.size()));
+            if (BuildDb *db = build_db()) {
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                db->set_duration(outputs_key(outputs), std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+            }
+        }
+
+        finish_build(stale_inputs, stale_outputs, done_inputs, done_outputs);
+    }
+
+    bool Recipe::prepare_cmd(Cmd &cmd) const {
+        if (func || mapped) {
+            build();
+            return false;
+        }
+        if (!needs_rebuild()) return false;
+        if (restore_cached(inputs, outputs)) {
+            finish_build({}, {}, inputs, outputs);
+            return false;
+        }
+        cmd = command(inputs, outputs);
+        return true;
+    }
+
+    void Recipe::finish(int64_t duration_ms) const {
+        if (BuildDb *db = build_db(); db && duration_ms >= 0) db->set_duration(outputs_key(outputs), duration_ms);
+        finish_build(inputs, outputs, {}, {});
+    }
+
+    void Recipe::finish_build(const Paths &stale_inputs, const Paths &stale_outputs, Paths done_inputs, Paths done_outputs) const {
+        StatCache &cache = stat_cache();
+        for (const auto &output : outputs) cache.invalidate(output);
+
+        {
+            vector<bool> exists(outputs.size(), true);
+            bool any_missing = false;
+            for (int i = 0; i < outputs.size(); ++i) {
+                if (!cache.get(outputs[i]).exists) {
+                    exists[i] = false;
+                    any_missing = true;
+                }
+            }
+            if (any_missing) {
+                std::cerr << "[ERROR] Recipe did not produce expected outputs:" << std::endl;
+                vector<string> output_strings;
+                for (auto &input : outputs) output_strings.push_back(input.string());
+                checklist(output_strings, exists);
+                if (build_error_scopes > 0) throw BuildError("Recipe did not produce expected outputs.");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        size_t built = stale_outputs.size();
+        done_inputs.insert(done_inputs.end(), stale_inputs.begin(), stale_inputs.end());
+        done_outputs.insert(done_outputs.end(), stale_outputs.begin(), stale_outputs.end());
+
+        if (depfiles) {
+            for (const auto &output : done_outputs) {
+                path depfile = depfile_path(output);
+                cache.invalidate(depfile);
+                if (cache.get(depfile).exists) record_deps(output, parse_depfile(depfile));
+            }
+        }
+
+        if (mapped) {
+            for (size_t i = 0; i < done_inputs.size(); ++i) record({done_inputs[i]}, {done_outputs[i]});
+            for (size_t i = 0; i < stale_inputs.size(); ++i) store_cached({stale_inputs[i]}, {stale_outputs[i]});
+        } else {
+            record(inputs, outputs);
+            if (built > 0) store_cached(inputs, outputs);
+        }
+    }
+
+    Graph::Graph() : jobs(sysconf(_SC_NPROCESSORS_ONLN)) {
+        if (jobs == 0) jobs = 1; // Fallback
+    }
+
+    Graph::Graph(size_t jobs) : jobs(jobs) {
+        assert(jobs > 0 && "Job count must be greater than 0");
+    }
+
+    Graph& Graph::add(Recipe recipe) {
+        recipes.push_back(std::move(recipe));
+        return *this;
+    }
+
+    void Graph::infer_edges() {
+        std::unordered_map<string, size_t> producers;
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            for (const auto &output : recipes[i].outputs) {
+                string key = output.lexically_normal().string();
+                auto [it, inserted] = producers.emplace(key, i);
+                if (!inserted) PANIC("Output '" + output.string() + "' is produced by more than one recipe.");
+            }
+        }
+
+        deps.assign(recipes.size(), {});
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            for (const auto &input : recipes[i].inputs) {
+                auto it = producers.find(input.lexically_normal().string());
+                if (it == producers.end()) continue;
+                auto &d = deps[i];
+                if (std::find(d.begin(), d.end(), it->second) == d.end()) d.push_back(it->second);
+            }
+        }
+    }
+
+    vector<size_t> Graph::order() {
+        infer_edges();
+
+        // Kahn's algorithm
+        vector<size_t> pending(recipes.size(), 0);
+        vector<vector<size_t>> dependents(recipes.size());
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            pending[i] = deps[i].size();
+            for (size_t d : deps[i]) dependents[d].push_back(i);
+        }
+
+        vector<size_t> result;
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            if (pending[i] == 0) result.push_back(i);
+        }
+        for (size_t n = 0; n < result.size(); ++n) {
+            for (size_t dependent : dependents[result[n]]) {
+                if (--pending[dependent] == 0) result.push_back(dependent);
+            }
+        }
+
+        if (result.size() != recipes.size()) PANIC("Recipe graph contains a cycle.");
+
+        return result;
+    }
+
+    vector<int64_t> Graph::critical_path(const vector<vector<size_t>> &dependents) {
+        // Recipes without history count as the average duration, or 1 without any history.
+        // Short recipes also count as 1, so only the length of their paths matters.
+        BuildDb *db = build_db();
+        vector<int64_t> duration(recipes.size(), -1);
+        int64_t total = 0, known = 0;
+        for (size_t i = 0; i < recipes.size() && db; ++i) {
+            if (db->get_duration(outputs_key(recipes[i].outputs), &duration[i])) {
+                if (duration[i] < SCHEDULE_MIN_MS) duration[i] = 1;
+                total += duration[i];
+                known++;
+            }
+        }
+        int64_t fallback = known > 0 ? total / known : 1;
+
+        // Walk the recipes backwards, so all dependents are known before their dependencies
+        vector<size_t> sorted = order();
+        vector<int64_t> remaining(recipes.size(), 0);
+        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
+            int64_t longest = 0;
+            for (size_t dependent : dependents[*it]) longest = std::max(longest, remaining[dependent]);
+            remaining[*it] = (duration[*it] < 0 ? fallback : duration[*it]) + longest;
+        }
+        return remaining;
+    }
+
+    void Graph::build() {
+        try {
+            build_selected(vector<bool>(recipes.size(), true));
+        } catch (const BuildError &e) {
+            std::cerr << term::RED << "[ERROR] " << e.what() << term::RESET << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void Graph::build_selected(const vector<bool> &selected) {
+        order(); // Infers edges and checks for cycles
+
+        // Recipes that are not selected count as built
+        size_t total = 0;
+        vector<size_t> pending(recipes.size(), 0);
+        vector<vector<size_t>> dependents(recipes.size());
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            if (selected[i]) total++;
+            for (size_t d : deps[i]) {
+                dependents[d].push_back(i);
+                if (selected[d]) pending[i]++;
+            }
+        }
 
-    CmdRunner::CmdRunner(vector<Cmd> cmds) :
-        process_count(sysconf(_SC_NPROCESSORS_ONLN)),
-        slots(vector<CmdRunnerSlot>(process_count)),
-        cmds(std::move(cmds))
-    {
-        init_slots();
-        if (process_count == 0) process_count = 1; // Fallback
+        // Ready recipes with the longest remaining path go first, ties in the order they were added
+        vector<int64_t> priority = critical_path(dependents);
+        auto later = [&](size_t a, size_t b) {
+            if (priority[a] != priority[b]) return priority[a] < priority[b];
+            return a > b;
+        };
+        std::priority_queue<size_t, vector<size_t>, decltype(later)> ready(later);
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            if (selected[i] && pending[i] == 0) ready.push(i);
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t finished = 0;
+        std::exception_ptr error = nullptr;
+
+        auto worker = [&]() {
+            BuildErrorScope scope; // Failures are rethrown on the calling thread once all workers are joined
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                cv.wait(lock, [&]() { return !ready.empty() || finished == total || error; });
+                if (error || ready.empty()) return;
+
+                size_t index = ready.top();
+                ready.pop();
+
+                lock.unlock();
+                std::exception_ptr recipe_error = nullptr;
+                try {
+                    recipes[index].build();
+                } catch (...) {
+                    recipe_error = std::current_exception();
+                }
+                lock.lock();
+
+                finished++;
+                if (recipe_error && !error) error = recipe_error;
+                if (!error) {
+                    for (size_t dependent : dependents[index]) {
+                        if (selected[dependent] && --pending[dependent] == 0) ready.push(dependent);
+                    }
+                }
+                cv.notify_all();
+            }
+        };
+
+        size_t thread_count = std::min(jobs, total);
+        vector<std::thread> threads;
+        for (size_t i = 0; i < thread_count; ++i) threads.emplace_back(worker);
+        for (auto &thread : threads) thread.join();
+
+        if (error) std::rethrow_exception(error);
     }
 
-    CmdRunner::CmdRunner(vector<Cmd> cmds, size_t process_count) :
-        process_count(process_count),
-        slots(vector<CmdRunnerSlot>(process_count)),
-        cmds(std::move(cmds))
-    {
-        init_slots();
-        if (process_count == 0) process_count = 1; // Fallback
+    void Graph::watch(std::function<void()> on_built) {
+        order(); // Infers edges and checks for cycles
+        vector<vector<size_t>> dependents(recipes.size());
+        std::unordered_map<string, size_t> producers;
+        for (size_t i = 0; i < recipes.size(); ++i) {
+            for (size_t d : deps[i]) dependents[d].push_back(i);
+            for (const auto &output : recipes[i].outputs) producers[output.lexically_normal().string()] = i;
+        }
+
+        FileWatcher watcher;
+        vector<bool> selected(recipes.size(), true);
+        for (;;) {
+            bool failed = true;
+            try {
+                build_selected(selected);
+                failed = false;
+            } catch (const std::exception &e) {
+                std::cerr << term::RED << "[ERROR] " << e.what() << term::RESET << std::endl;
+            } catch (...) {
+                std::cerr << term::RED << "[ERROR] Recipe failed with an unknown exception" << term::RESET << std::endl;
+            }
+
+            // Dependencies are collected again after every build, since depfiles may have changed
+            std::unordered_map<string, vector<size_t>> users;
+            for (size_t i = 0; i < recipes.size(); ++i) {
+                for (const auto &dep : recipes[i].all_dependencies()) {
+                    watcher.add(dep);
+                    users[dep.lexically_normal().string()].push_back(i);
+                }
+            }
+
+            // Outputs written by the build itself are not changes, but edits made during the build are
+            Paths changed;
+            for (const auto &file : watcher.wait(0)) {
+                if (!producers.count(file.lexically_normal().string())) changed.push_back(file);
+            }
+            if (changed.empty()) {
+                if (on_built) on_built();
+                changed = watcher.wait();
+            }
+
+            // Select the recipes using the changed files and everything depending on them. After a
+            // failure, the recipes which were not built yet stay selected as well.
+            if (!failed) selected.assign(recipes.size(), false);
+            vector<size_t> stack;
+            for (const auto &file : changed) {
+                for (size_t i : users[file.lexically_normal().string()]) stack.push_back(i);
+            }
+            while (!stack.empty()) {
+                size_t i = stack.back();
+                stack.pop_back();
+                if (selected[i]) continue;
+                selected[i] = true;
+                for (size_t dependent : dependents[i]) stack.push_back(dependent);
+            }
+        }
     }
 
-    CmdRunner::CmdRunner():
-        process_count(sysconf(_SC_NPROCESSORS_ONLN)),
-        slots(vector<CmdRunnerSlot>(process_count))
-    {
-        init_slots();
-        if (process_count == 0) process_count = 1; // Fallback
+    // Writes `content` to `file` unless it already holds exactly that. Returns `true` if it was written.
+    bool write_if_changed(const path &file, const string &content) {
+        if (stat_file(file).size == content.size() && read_file(file) == content) return false;
+        if (!write_atomically(file, content)) PANIC("Could not write " + file.string() + ": " + string(strerror(errno)));
+        stat_cache().invalidate(file);
+        return true;
     }
 
-    size_t CmdRunner::size() {
-        return cmds.size();
+    // Renders a command as a line for sh, including the stages and redirects of a pipeline
+    string shell_command(const Cmd &cmd) {
+        // Only words with special characters are quoted, to keep the line readable
+        auto word = [](const string &text) {
+            bool plain = !text.empty();
+            for (char c : text) plain = plain && (isalnum((unsigned char) c) || strchr("_@%+=:,./-", c));
+            return plain ? text : shell_quote(text);
+        };
+        auto stage = [&word](const Cmd &stage) {
+            string line;
+            for (const string &part : stage.get_parts()) line += (line.empty() ? "" : " ") + word(part);
+            if (stage.root != ".") line = "(cd " + word(stage.root.string()) + " && " + line + ")";
+            return line;
+        };
+        string input = cmd.stdin_file.empty() ? "" : " < " + word(cmd.stdin_file.string());
+        string line;
+        for (const Cmd &earlier : cmd.get_stages()) {
+            line += stage(earlier) + (line.empty() ? input : "") + " | ";
+        }
+        line += stage(cmd) + (cmd.get_stages().empty() ? input : "");
+        if (!cmd.stdout_file.empty()) line += " > " + word(cmd.stdout_file.string());
+        return line;
     }
 
-    void CmdRunner::push(Cmd cmd) {
-        cmd.silent = true;
-        cmds.push_back(cmd);
+    // Escapes a variable value for ninja
+    string ninja_escape(const string &text) {
+        string result;
+        for (char c : text) {
+            if (c == '$') result += "$$";
+            else if (c == '\n') result += ' ';
+            else result += c;
+        }
+        return result;
     }
 
-    void CmdRunner::push_many(vector<Cmd> cmds) {
-        for (const auto &cmd : cmds) {
-            push(cmd);
+    // Escapes a path in a build statement for ninja
+    string ninja_path(const path &file) {
+        string result;
+        for (char c : file.lexically_normal().string()) {
+            if (c == '$' || c == ' ' || c == ':') result += '$';
+            result += c;
         }
+        return result;
     }
 
-    void CmdRunner::clear() {
-        cmds.clear();
-        exit_codes.clear();
+    // Every set of inputs and outputs a command template of `recipe` runs for, one per pair when it is mapped
+    vector<std::pair<Paths, Paths>> command_jobs(const Recipe &recipe) {
+        vector<std::pair<Paths, Paths>> jobs;
+        if (!recipe.mapped) jobs.push_back({recipe.inputs, recipe.outputs});
+        else for (size_t i = 0; i < recipe.outputs.size() && i < recipe.inputs.size(); i++) {
+            jobs.push_back({{recipe.inputs[i]}, {recipe.outputs[i]}});
+        }
+        return jobs;
     }
 
-    bool CmdRunner::run() {
-        exit_codes.resize(cmds.size(), -1);
-        cursor = 0;
-        populate_slots();
-        while (any_waiting()) {
-            if (populate_slots()) continue;
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    bool Graph::write_ninja(const path &file, const Cmd &regenerate, const Paths &sources) {
+        string ninja = "# Generated by bob, do not edit. Edit the bob source instead.\n"
+                       "ninja_required_version = 1.3\n\n"
+                       "rule cmd\n  command = $cmd\n  description = $cmd\n\n"
+                       "rule cmd_depfile\n  command = $cmd\n  description = $cmd\n  depfile = $depfile\n\n";
+
+        if (!regenerate.get_parts().empty()) {
+            ninja += "rule regenerate\n  command = " + ninja_escape(shell_command(regenerate)) + "\n"
+                     "  description = Regenerating $out\n  generator = 1\n  restat = 1\n\n";
+            ninja += "build " + ninja_path(file) + ": regenerate";
+            // `__FILE__` is relative to where bob was compiled, which is where it runs
+            Paths inputs = sources;
+            inputs.push_back(fs::absolute(__FILE__));
+            for (const path &input : inputs) ninja += " " + ninja_path(input);
+            ninja += "\n\n";
         }
-        await_slots();
-        return !any_failed();
+
+        for (const Recipe &recipe : recipes) {
+            if (recipe.cmd.get_parts().empty() || recipe.cmd.task) {
+                string outputs;
+                for (const path &output : recipe.outputs) outputs += " " + output.string();
+                WARNING("Recipe for" + outputs + " is built by a function or task and cannot be exported to ninja.");
+                continue;
+            }
+            for (const auto &[inputs, outputs] : command_jobs(recipe)) {
+                // A depfile is only read for the first output, which is all ninja supports
+                ninja += "build";
+                for (const path &output : outputs) ninja += " " + ninja_path(output);
+                ninja += string(": ") + (recipe.depfiles ? "cmd_depfile" : "cmd");
+                for (const path &input : inputs) ninja += " " + ninja_path(input);
+                ninja += "\n  cmd = " + ninja_escape(shell_command(recipe.command(inputs, outputs))) + "\n";
+                if (recipe.depfiles && !outputs.empty()) {
+                    ninja += "  depfile = " + ninja_escape(depfile_path(outputs[0]).lexically_normal().string()) + "\n";
+                }
+            }
+        }
+
+        return write_if_changed(file, ninja);
     }
 
-    bool CmdRunner::all_succeded() {
-        return !any_failed();
+    // Checks if a file is compiled as C, C++ or Objective-C
+    bool is_compiled_source(const path &file) {
+        static const std::unordered_set<string> extensions = {
+            ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".m", ".mm",
+        };
+        return extensions.count(file.extension().string()) > 0;
     }
 
-    bool CmdRunner::any_failed() {
-        for (auto &exit_code : exit_codes) {
-            if (exit_code != 0) return true;
+    bool Graph::write_compile_commands(const path &file) {
+        string json = "[";
+        bool first = true;
+        for (const Recipe &recipe : recipes) {
+            if (recipe.cmd.get_parts().empty() || recipe.cmd.task) continue;
+            for (const auto &[inputs, outputs] : command_jobs(recipe)) {
+                Cmd cmd = recipe.command(inputs, outputs);
+                path root = fs::absolute(cmd.root).lexically_normal();
+                string directory = (root.has_filename() ? root : root.parent_path()).string();
+                string arguments;
+                for (const string &part : cmd.get_parts()) {
+                    arguments += (arguments.empty() ? "\"" : ", \"") + json_escape(part) + "\"";
+                }
+                for (const path &input : inputs) {
+                    if (!is_compiled_source(input)) continue;
+                    // Paths in the command are relative to bob, the directory of the entry to the command
+                    path source = fs::absolute(input).lexically_normal();
+                    json += string(first ? "\n" : ",\n") + "  {\n"
+                            "    \"directory\": \"" + json_escape(directory) + "\",\n"
+                            "    \"arguments\": [" + arguments + "],\n"
+                            "    \"file\": \"" + json_escape(source.string()) + "\"";
+                    if (outputs.size() == 1) {
+                        json += ",\n    \"output\": \"" + json_escape(fs::absolute(outputs[0]).lexically_normal().string()) + "\"";
+                    }
+                    json += "\n  }";
+                    first = false;
+                }
+            }
         }
-        return false;
+        json += first ? "]\n" : "\n]\n";
+        return write_if_changed(file, json);
     }
-    
-    void CmdRunner::print_failed() {
-        for (size_t i = 0; i < cmds.size(); ++i) {
-            if (exit_codes[i] != 0) {
-                std::cerr << term::RED << "[FAILED] " << cmds[i].render() << " (exit code: " << exit_codes[i] << ")" << term::RESET << std::endl;
-                if (!cmds[i].output_str.empty()) {
-                    std::cerr << cmds[i].output_str;
-                }
+
+    // Name of the wrapper file of unity group `index`
+    path unity_wrapper(const path &dir, size_t index, const Paths &sources) {
+        string extension = sources.empty() || sources[0].extension().empty() ? ".cpp" : sources[0].extension().string();
+        return dir / ("unity-" + std::to_string(index) + extension);
+    }
+
+    // Object file a unity build compiles a split off source into
+    path unity_standalone_object(const path &dir, const path &source) {
+        string name = source.stem().string() + "-" + hex(hash_string(source.lexically_normal().string())) + ".o";
+        return dir / name;
+    }
+
+    UnityBuild::UnityBuild(const Paths &sources, path dir, const Cmd &cmd, size_t groups)
+        : sources(sources), dir(dir), cmd(cmd), groups(groups ? groups : sysconf(_SC_NPROCESSORS_ONLN)) {}
+
+    vector<Paths> UnityBuild::read_groups() const {
+        vector<Paths> result;
+        for (size_t i = 0;; i++) {
+            path wrapper = unity_wrapper(dir, i, sources);
+            if (!stat_cache().get(wrapper).exists) break;
+            Paths group;
+            std::istringstream lines(read_file(wrapper));
+            string line;
+            while (std::getline(lines, line)) {
+                const string prefix = "#include \"";
+                if (line.rfind(prefix, 0) != 0 || line.size() <= prefix.size() + 1) continue;
+                path included = line.substr(prefix.size(), line.size() - prefix.size() - 1);
+                group.push_back((dir / included).lexically_normal());
             }
+            result.push_back(group);
         }
+        return result;
     }
 
-    void CmdRunner::capture_output(bool capture) {
-        for (auto &cmd : cmds) {
-            cmd.capture_output = capture;
+    vector<Paths> UnityBuild::balance(const Paths &grouped, const vector<Paths> &previous, size_t count) const {
+        // Compile time of every source, from its own compile or its share of the unit it was compiled
+        // in before. Sizes are used instead unless every source was timed.
+        BuildDb *db = build_db();
+        auto key = [](const path &file) { return file.lexically_normal().string(); };
+        std::unordered_map<string, double> size, ms;
+        Paths units, objects;
+        for (size_t i = 0; i < previous.size(); i++) {
+            units.push_back(unity_wrapper(dir, i, sources));
+            objects.push_back(dir / ("unity-" + std::to_string(i) + ".o"));
+        }
+        Recipe compile = Recipe::map(objects, units, cmd);
+        for (const path &source : grouped) size[key(source)] = stat_cache().get(source).size + 1;
+        for (const path &source : grouped) {
+            int64_t duration;
+            if (db && db->get_duration(command_key(compile.command({source}, {unity_standalone_object(dir, source)})), &duration)) {
+                ms[key(source)] = duration;
+            }
+        }
+        for (size_t i = 0; db && i < previous.size(); i++) {
+            int64_t duration;
+            if (!db->get_duration(command_key(compile.command({units[i]}, {objects[i]})), &duration)) continue;
+            Paths untimed;
+            double total = 0;
+            for (const path &source : previous[i]) {
+                if (!size.count(key(source)) || ms.count(key(source))) continue;
+                untimed.push_back(source);
+                total += size[key(source)];
+            }
+            for (const path &source : untimed) ms[key(source)] = duration * size[key(source)] / total;
+        }
+        bool timed = ms.size() == grouped.size();
+        auto cost = [&](const path &source) { return timed ? ms[key(source)] : size[key(source)]; };
+
+        vector<Paths> result(count);
+        vector<double> load(count, 0);
+        std::unordered_set<string> placed;
+        std::unordered_set<string> wanted;
+        for (const path &source : grouped) wanted.insert(key(source));
+
+        // With the same number of groups, sources keep their group and only new ones are placed
+        if (previous.size() == count) {
+            for (size_t i = 0; i < count; i++) {
+                for (const path &source : previous[i]) {
+                    if (!wanted.count(key(source)) || placed.count(key(source))) continue;
+                    result[i].push_back(source);
+                    load[i] += cost(source);
+                    placed.insert(key(source));
+                }
+            }
+        }
+
+        // The heaviest sources are placed first, each in the lightest group
+        Paths remaining;
+        for (const path &source : grouped) if (!placed.count(key(source))) remaining.push_back(source);
+        std::stable_sort(remaining.begin(), remaining.end(), [&](const path &a, const path &b) { return cost(a) > cost(b); });
+        for (const path &source : remaining) {
+            size_t lightest = std::min_element(load.begin(), load.end()) - load.begin();
+            result[lightest].push_back(source);
+            load[lightest] += cost(source);
         }
+        for (Paths &group : result) std::sort(group.begin(), group.end());
+        return result;
     }
 
-    Recipe::Recipe(const Paths &outputs, const Paths &inputs, RecipeFunc func)
-            : inputs(inputs), outputs(outputs), func(func) {}
+    Recipe UnityBuild::recipe() {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        auto key = [](const path &file) { return file.lexically_normal().string(); };
+        path list = dir / "standalone.list";
 
-    bool Recipe::needs_rebuild() const {
-        for (const auto &input : inputs) {
-            for (const auto &output : outputs) {
-                if (file_needs_rebuild(input, output)) {
-                    return true;
+        std::unordered_set<string> present;
+        for (const path &source : sources) present.insert(key(source));
+
+        vector<Paths> previous = read_groups();
+        std::unordered_set<string> standalone;
+        std::istringstream lines(read_file(list));
+        for (string line; std::getline(lines, line);) {
+            if (present.count(line)) standalone.insert(line);
+        }
+
+        // Sources edited since their unit was compiled are split off, unless most of the unit changed.
+        // When no unit has been compiled, the build is clean and everything is grouped again. With the
+        // build database a source is edited when its content changed since the previous build, so
+        // touching it does not split it off. Without it, or for sources it has not seen, it is the mtime.
+        BuildDb *db = build_db();
+        bool clean = true;
+        for (size_t i = 0; i < previous.size(); i++) {
+            FileStat object = stat_cache().get(dir / ("unity-" + std::to_string(i) + ".o"));
+            if (!object.exists) continue;
+            clean = false;
+            Paths edited;
+            for (const path &source : previous[i]) {
+                FileStat stat = stat_cache().get(source);
+                if (!present.count(key(source)) || !stat.exists) continue;
+                uint64_t command, built;
+                if (db && db->get_signature("unity " + key(source), &command, &built)) {
+                    if (db->hash(source) != built) edited.push_back(source);
+                } else if (stat.mtime > object.mtime) {
+                    edited.push_back(source);
                 }
             }
+            if (edited.size() * 2 >= previous[i].size()) continue;
+            for (const path &source : edited) standalone.insert(key(source));
         }
-        return false;
+        if (clean) standalone.clear();
+
+        Paths grouped, alone;
+        for (const path &source : sources) (standalone.count(key(source)) ? alone : grouped).push_back(source);
+        std::sort(alone.begin(), alone.end());
+
+        size_t count = std::min(groups, grouped.size());
+        vector<Paths> assigned = balance(grouped, previous, count);
+
+        Paths units, objects;
+        for (size_t i = 0; i < count; i++) {
+            path wrapper = unity_wrapper(dir, i, sources);
+            string content = "// Generated by bob, do not edit.\n";
+            for (const path &source : assigned[i]) {
+                path relative = fs::absolute(source).lexically_normal().lexically_relative(fs::absolute(dir).lexically_normal());
+                content += "#include \"" + relative.string() + "\"\n";
+            }
+            write_if_changed(wrapper, content);
+            units.push_back(wrapper);
+            objects.push_back(dir / ("unity-" + std::to_string(i) + ".o"));
+        }
+        for (size_t i = count; i < previous.size(); i++) {
+            fs::remove(unity_wrapper(dir, i, sources), ec);
+            stat_cache().invalidate(unity_wrapper(dir, i, sources));
+        }
+        for (const path &source : alone) {
+            units.push_back(source);
+            objects.push_back(unity_standalone_object(dir, source));
+        }
+
+        string content;
+        for (const path &source : alone) content += key(source) + "\n";
+        write_if_changed(list, content);
+
+        // The content the units are compiled from, to tell edits from touches in the next build
+        for (const path &source : db ? sources : Paths{}) {
+            if (!stat_cache().get(source).exists) continue;
+            uint64_t command, built, hash = db->hash(source);
+            if (!db->get_signature("unity " + key(source), &command, &built) || built != hash) {
+                db->set_signature("unity " + key(source), 0, hash);
+            }
+        }
+
+        Recipe recipe = Recipe::map(objects, units, cmd);
+        recipe.depfiles = true;
+        return recipe;
     }
 
-    void Recipe::build() const {
-        {
-            vector<bool> exists(inputs.size(), true);
-            bool any_missing = false;
-            for (int i = 0; i < inputs.size(); ++i) {
-                if (!fs::exists(inputs[i])) {
-                    exists[i] = false;
-                    any_missing = true;
+    // A recorded test in the format of rere.py
+    struct TestSnapshot {
+        string shell;
+        int returncode = 0;
+        string out;
+        string err;
+    };
+
+    // Reads the snapshots of `file`. Returns `false` if it is missing or malformed.
+    bool read_snapshots(const path &file, vector<TestSnapshot> &snapshots) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in) return false;
+        auto int_field = [&in](const string &name, int &value) {
+            string line;
+            if (!std::getline(in, line) || line.rfind(":i " + name + " ", 0) != 0) return false;
+            value = std::stoi(line.substr(name.size() + 4));
+            return true;
+        };
+        std::error_code ec;
+        uintmax_t file_size = fs::file_size(file, ec);
+        auto blob_field = [&in, file_size](const string &name, string &value) {
+            string line;
+            if (!std::getline(in, line) || line.rfind(":b " + name + " ", 0) != 0) return false;
+            size_t size = std::stoul(line.substr(name.size() + 4));
+            if (size > file_size) return false;
+            value.resize(size);
+            in.read(value.data(), value.size());
+            return in.get() == '\n';
+        };
+        // Numbers which do not parse, and sizes which do not fit, throw
+        try {
+            int count;
+            if (!int_field("count", count) || count < 0) return false;
+            snapshots.resize(count);
+            for (TestSnapshot &snapshot : snapshots) {
+                if (!blob_field("shell", snapshot.shell) || !int_field("returncode", snapshot.returncode)
+                    || !blob_field("stdout", snapshot.out) || !blob_field("stderr", snapshot.err)) return false;
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+        return true;
+    }
+
+    void write_snapshots(const path &file, const vector<TestSnapshot> &snapshots) {
+        string content = ":i count " + std::to_string(snapshots.size()) + "\n";
+        auto blob = [&content](const string &name, const string &value) {
+            content += ":b " + name + " " + std::to_string(value.size()) + "\n" + value + "\n";
+        };
+        for (const TestSnapshot &snapshot : snapshots) {
+            blob("shell", snapshot.shell);
+            content += ":i returncode " + std::to_string(snapshot.returncode) + "\n";
+            blob("stdout", snapshot.out);
+            blob("stderr", snapshot.err);
+        }
+        write_if_changed(file, content);
+    }
+
+    // Shows where `actual` differs from `expected`, with the common lines at both ends left out
+    string diff_lines(const string &expected, const string &actual) {
+        auto split = [](const string &text) {
+            vector<string> lines;
+            std::istringstream in(text);
+            for (string line; std::getline(in, line);) lines.push_back(line);
+            return lines;
+        };
+        vector<string> a = split(expected), b = split(actual);
+        size_t start = 0;
+        while (start < a.size() && start < b.size() && a[start] == b[start]) start++;
+        size_t end = 0;
+        while (end < a.size() - start && end < b.size() - start && a[a.size() - 1 - end] == b[b.size() - 1 - end]) end++;
+        string result = "--- expected\n+++ actual\n";
+        for (size_t i = start; i < a.size() - end; i++) result += "-" + a[i] + "\n";
+        for (size_t i = start; i < b.size() - end; i++) result += "+" + b[i] + "\n";
+        return result;
+    }
+
+    TestRunner::TestRunner(size_t process_count)
+        : process_count(process_count ? process_count : sysconf(_SC_NPROCESSORS_ONLN)) {}
+
+    void TestRunner::add(const path &dir, vector<Cmd> prepare, vector<Recipe> build) {
+        cases.push_back({dir, std::move(prepare), std::move(build)});
+    }
+
+    bool TestRunner::replay() {
+        return run(false);
+    }
+
+    bool TestRunner::record() {
+        return run(true);
+    }
+
+    bool TestRunner::run(bool recording) {
+        // Where each case is: its prepare commands, then its recipes, then its tests
+        struct Progress {
+            size_t step = 0;
+            vector<string> shells;
+            vector<TestSnapshot> expected;
+            vector<TestSnapshot> recorded;
+            bool failed = false;
+            bool running = false;
+        };
+        struct Job {
+            size_t index;
+            size_t step;
+            Cmd cmd;
+            CmdFuture fut;
+            //! True if the job holds a job slot of the jobserver.
+            bool token;
+        };
+
+        auto steps = [this](size_t index) { return cases[index].prepare.size() + cases[index].build.size(); };
+
+        OutputSink &sink = output_sink();
+        results.clear();
+        bool all_passed = true;
+        vector<Progress> progress(cases.size());
+        for (size_t i = 0; i < cases.size(); ++i) {
+            Progress &p = progress[i];
+            path list = cases[i].dir / "test.list";
+            std::istringstream lines(read_file(list));
+            for (string line; std::getline(lines, line);) {
+                size_t first = line.find_first_not_of(" \t\r");
+                size_t last = line.find_last_not_of(" \t\r");
+                if (first != string::npos) p.shells.push_back(line.substr(first, last - first + 1));
+            }
+            sink.add_jobs(steps(i) + p.shells.size());
+            if (recording) continue;
+
+            string problem;
+            path bi = list;
+            bi += ".bi";
+            if (!read_snapshots(bi, p.expected)) problem = "Could not read " + bi.string();
+            else if (p.expected.size() != p.shells.size()) {
+                problem = "Expected " + std::to_string(p.expected.size()) + " tests but " + list.string()
+                        + " has " + std::to_string(p.shells.size()) + ", record them again";
+            }
+            if (!problem.empty()) {
+                results.push_back({cases[i].dir, list.string(), false, 0, problem + "\n"});
+                sink.skip_jobs(steps(i) + p.shells.size());
+                p.failed = true;
+                all_passed = false;
+            }
+        }
+
+        // Cases with the most tests left start first, since they end the run
+        auto remaining = [&](size_t index) { return steps(index) + progress[index].shells.size() - progress[index].step; };
+        auto finished = [&](size_t index) { return progress[index].failed || remaining(index) == 0; };
+        auto next_case = [&]() {
+            int next = -1;
+            for (size_t i = 0; i < cases.size(); ++i) {
+                if (progress[i].running || finished(i)) continue;
+                if (next < 0 || remaining(i) > remaining(next)) next = i;
+            }
+            return next;
+        };
+
+        // Like a `CmdRunner`, every job beyond the first needs a job slot of the jobserver
+        Jobserver *js = jobserver();
+        std::list<Job> jobs;
+        for (;;) {
+            // Fill free slots with the next step of the cases which are not busy
+            bool token = false;
+            while (jobs.size() < process_count) {
+                int next = next_case();
+                if (next < 0) break;
+                if (js && !token) {
+                    if (!js->try_acquire()) break;
+                    token = true;
+                }
+
+                const TestCase &test_case = cases[next];
+                Progress &p = progress[next];
+                size_t prepares = test_case.prepare.size();
+                Cmd cmd;
+                if (p.step < prepares) {
+                    cmd = test_case.prepare[p.step];
+                } else if (p.step < steps(next)) {
+                    if (!test_case.build[p.step - prepares].prepare_cmd(cmd)) {
+                        // Up to date, restored from the artifact cache or built already
+                        sink.skip_jobs(1);
+                        p.step++;
+                        continue;
+                    }
+                } else {
+                    cmd = Cmd({"sh", "-c", p.shells[p.step - steps(next)]}, test_case.dir);
+                    cmd.spawn = SpawnMode::Pipe;
+                    cmd.separate_stderr = true;
+                    cmd.timeout_ms = timeout_ms;
                 }
+                cmd.capture_output = true;
+                cmd.silent = true;
+                cmd.echo = false;
+                jobs.push_back({(size_t) next, p.step, std::move(cmd), CmdFuture(), token});
+                jobs.back().fut = jobs.back().cmd.run_async();
+                p.running = true;
+                token = false;
             }
-            if (any_missing) {
-                std::cerr << "[ERROR] Recipe inputs are missing:" << std::endl;
-                vector<string> input_strings;
-                for (auto &input : inputs) input_strings.push_back(input.string());
-                checklist(input_strings, exists);
-                exit(EXIT_FAILURE);
+            if (token) js->release();
+            if (jobs.empty()) break;
+
+            // Also wake up when a job slot may have been returned to the jobserver
+            sink.flush();
+            vector<const CmdFuture *> futs;
+            for (const Job &job : jobs) futs.push_back(&job.fut);
+            bool waiting = js && jobs.size() < process_count && next_case() >= 0;
+            wait_futures(futs, -1, waiting ? js->fd() : -1);
+
+            for (auto it = jobs.begin(); it != jobs.end();) {
+                Job &job = *it;
+                if (!job.cmd.poll_future(job.fut)) {
+                    ++it;
+                    continue;
+                }
+                if (job.token) js->release();
+                const TestCase &test_case = cases[job.index];
+                Progress &p = progress[job.index];
+                p.running = false;
+                p.step++;
+                double ms = job.fut.stats.wall_ms;
+                string name = test_case.dir.filename().string() + ": ";
+                if (job.step < steps(job.index)) {
+                    // A setup command, which only reports its failures
+                    sink.job_finished(name + job.cmd.render());
+                    if (job.fut.exit_code != 0) {
+                        results.push_back({test_case.dir, job.cmd.render(), false, ms, job.cmd.output_str + job.cmd.error_str});
+                        sink.skip_jobs(remaining(job.index));
+                        p.failed = true;
+                        all_passed = false;
+                    } else if (job.step >= test_case.prepare.size()) {
+                        test_case.build[job.step - test_case.prepare.size()].finish((int64_t) ms);
+                    }
+                } else {
+                    size_t test = job.step - steps(job.index);
+                    TestSnapshot actual{p.shells[test], job.fut.exit_code, job.cmd.output_str, job.cmd.error_str};
+                    string message;
+                    if (recording) {
+                        p.recorded.push_back(actual);
+                    } else {
+                        const TestSnapshot &expected = p.expected[test];
+                        if (expected.shell != actual.shell) {
+                            message += "UNEXPECTED: shell command\n    EXPECTED: " + expected.shell + "\n    ACTUAL:   " + actual.shell + "\n";
+                        }
+                        if (expected.returncode != actual.returncode) {
+                            message += "UNEXPECTED: return code\n    EXPECTED: " + std::to_string(expected.returncode)
+                                     + "\n    ACTUAL:   " + std::to_string(actual.returncode) + "\n";
+                        }
+                        if (expected.out != actual.out) message += "UNEXPECTED: stdout\n" + diff_lines(expected.out, actual.out);
+                        if (expected.err != actual.err) message += "UNEXPECTED: stderr\n" + diff_lines(expected.err, actual.err);
+                    }
+                    results.push_back({test_case.dir, actual.shell, message.empty(), ms, message});
+                    sink.job_finished(name + actual.shell);
+                    if (!message.empty()) {
+                        // Later tests depend on this one, so the case ends here
+                        sink.skip_jobs(remaining(job.index));
+                        p.failed = true;
+                        all_passed = false;
+                    }
+                }
+                if (recording && !p.failed && remaining(job.index) == 0) {
+                    write_snapshots(test_case.dir / "test.list.bi", p.recorded);
+                }
+                it = jobs.erase(it);
             }
         }
+        sink.flush();
+        return all_passed;
+    }
 
-        if (!needs_rebuild()) return;
+    void TestRunner::print_failed() const {
+        for (const Result &result : results) {
+            if (result.passed) continue;
+            std::cerr << term::RED << "[FAILED] " << result.dir.string() << ": " << result.shell << term::RESET << std::endl;
+            std::cerr << result.message;
+        }
+    }
 
-        func(inputs, outputs);
+    void TestRunner::print_timings(size_t count) const {
+        auto seconds = [](double ms) {
+            std::ostringstream oss;
+            oss.setf(std::ios::fixed);
+            oss.precision(2);
+            oss << ms / 1000.0 << " s";
+            return oss.str();
+        };
 
-        {
-            vector<bool> exists(outputs.size(), true);
-            bool any_missing = false;
-            for (int i = 0; i < outputs.size(); ++i) {
-                if (!fs::exists(outputs[i])) {
-                    exists[i] = false;
-                    any_missing = true;
+        vector<const Result *> sorted;
+        for (const Result &result : results) sorted.push_back(&result);
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Result *a, const Result *b) { return a->ms > b->ms; });
+        std::cout << "Slowest tests:" << std::endl;
+        for (size_t i = 0; i < count && i < sorted.size(); i++) {
+            std::cout << "  " << std::setw(8) << seconds(sorted[i]->ms) << "  " << sorted[i]->dir.string() << ": " << sorted[i]->shell << std::endl;
+        }
+
+        std::cout << "Test cases:" << std::endl;
+        for (const TestCase &test_case : cases) {
+            double total = 0;
+            for (const Result &result : results) if (result.dir == test_case.dir) total += result.ms;
+            std::cout << "  " << std::setw(8) << seconds(total) << "  " << test_case.dir.string() << std::endl;
+        }
+    }
+
+    // How often files are checked for changes when inotify is not available.
+    const int WATCH_POLL_MS = 250;
+
+    // Changes arriving within this time are reported together, e.g. when an editor saves several files.
+    const int WATCH_DEBOUNCE_MS = 30;
+
+    FileWatcher::FileWatcher() {
+        #ifdef __linux__
+            inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        #endif
+    }
+
+    FileWatcher::~FileWatcher() {
+        if (inotify_fd >= 0) close(inotify_fd);
+    }
+
+    bool FileWatcher::native() const {
+        return inotify_fd >= 0;
+    }
+
+    void FileWatcher::add(const path &file) {
+        string key = file.lexically_normal().string();
+        if (files.count(key)) return;
+        files[key] = stat_file(file);
+
+        if (inotify_fd < 0) return;
+        #ifdef __linux__
+            path dir = file.lexically_normal().parent_path();
+            if (dir.empty()) dir = ".";
+            for (const auto &[wd, watched] : dirs) {
+                if (watched == dir) return;
+            }
+            uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ATTRIB;
+            int wd = inotify_add_watch(inotify_fd, dir.c_str(), mask);
+            if (wd < 0) {
+                // The directory cannot be watched (e.g. too many watches), use polling for everything
+                close(inotify_fd);
+                inotify_fd = -1;
+                dirs.clear();
+                return;
+            }
+            dirs[wd] = dir;
+        #endif
+    }
+
+    void FileWatcher::clear() {
+        #ifdef __linux__
+            for (const auto &[wd, dir] : dirs) inotify_rm_watch(inotify_fd, wd);
+        #endif
+        dirs.clear();
+        files.clear();
+    }
+
+    void FileWatcher::read_events(Paths &changed) {
+        #ifdef __linux__
+            alignas(struct inotify_event) char buffer[16 * 1024];
+            for (;;) {
+                ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+                if (n <= 0) return;
+                for (char *p = buffer; p < buffer + n;) {
+                    auto *event = (struct inotify_event *) p;
+                    p += sizeof(struct inotify_event) + event->len;
+
+                    auto dir = dirs.find(event->wd);
+                    if (dir == dirs.end() || event->len == 0) continue;
+                    path file = (dir->second / event->name).lexically_normal();
+                    string key = file.string();
+                    if (!files.count(key)) continue;
+                    if (std::find(changed.begin(), changed.end(), file) == changed.end()) changed.push_back(file);
                 }
             }
-            if (any_missing) {
-                std::cerr << "[ERROR] Recipe did not produce expected outputs:" << std::endl;
-                vector<string> output_strings;
-                for (auto &input : outputs) output_strings.push_back(input.string());
-                checklist(output_strings, exists);
-                exit(EXIT_FAILURE);
+        #else
+            (void) changed;
+        #endif
+    }
+
+    void FileWatcher::poll_files(Paths &changed) {
+        for (auto &[key, last] : files) {
+            FileStat now = stat_file(key);
+            if (now.exists == last.exists && now.mtime == last.mtime && now.size == last.size) continue;
+            last = now;
+            path file = key;
+            if (std::find(changed.begin(), changed.end(), file) == changed.end()) changed.push_back(file);
+        }
+    }
+
+    Paths FileWatcher::wait(int timeout_ms) {
+        Paths changed;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+        for (;;) {
+            int wait_ms = -1;
+            if (timeout_ms >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                wait_ms = (int) std::max<int64_t>(left.count(), 0);
+            }
+
+            if (native()) {
+                struct pollfd fd = {inotify_fd, POLLIN, 0};
+                if (::poll(&fd, 1, wait_ms) > 0) read_events(changed);
+            } else {
+                int sleep_ms = wait_ms < 0 ? WATCH_POLL_MS : std::min(wait_ms, WATCH_POLL_MS);
+                std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+                poll_files(changed);
             }
+
+            if (!changed.empty() || wait_ms == 0) break;
+        }
+
+        // Collect the rest of a burst of changes
+        if (!changed.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_DEBOUNCE_MS));
+            if (native()) read_events(changed);
+            else          poll_files(changed);
         }
+
+        for (const auto &file : changed) {
+            stat_cache().invalidate(file);
+            files[file.string()] = stat_file(file);
+        }
+        return changed;
     }
 
     void print_cli_args(const CliFlags &args) {
@@ -1645,7 +7010,30 @@ namespace bob {
         set_defaults(argc, argv);
     }
 
+    Cli &Cli::add_trace_flag() {
+        if (trace_flag) return *this;
+        trace_flag = true;
+        // Before `--help`, so that stays the last flag of every command
+        auto help = std::find_if(flags.begin(), flags.end(), [](const CliFlag &flag) { return flag.long_name == "help"; });
+        flags.insert(help, CliFlag("trace", CliFlagType::Value, "Writes a Chrome trace of the build to a file"));
+        return *this;
+    }
+
     int Cli::serve() {
+        // Tracing is handled here, so it works for every command
+        for (size_t i = 0; trace_flag && i < raw_args.size(); ++i) {
+            const string &arg = raw_args[i];
+            if (arg.rfind("--trace=", 0) == 0) {
+                use_tracer(arg.substr(strlen("--trace=")));
+                raw_args.erase(raw_args.begin() + i);
+                break;
+            }
+            if (arg == "--trace" && i + 1 < raw_args.size()) {
+                use_tracer(raw_args[i + 1]);
+                raw_args.erase(raw_args.begin() + i, raw_args.begin() + i + 2);
+                break;
+            }
+        }
         return run(raw_args.size(), raw_args.data());
     }
 
@@ -0,0 +1,32 @@
+#define BOB_IMPLEMENTATION
+#include "bob.hpp"
+
+using namespace std;
+using namespace bob;
+
+int main(int argc, char *argv[]) {
+    GO_REBUILD_YOURSELF(argc, argv);
+
+    // Remember content hashes in `.bob/db`, so touched but unchanged files are not rebuilt
+    use_build_db();
+
+    // `./bob cache` also keeps the outputs in `.bob/cache`, so deleted outputs are restored from it
+    if (argc > 1 && string(argv[1]) == "cache") use_artifact_cache();
+
+    mkdirs("build");
+
+    auto objs = Recipe::map({"build/main.o", "build/greet.o"}, {"src/main.c", "src/greet.c"},
+                            Cmd({"gcc", "-MMD", "-c", "_INPUTS_", "-o", "_OUTPUTS_"}));
+    objs.depfiles = true; // Rebuild objects when the headers they include change
+
+    Graph graph;
+    graph.add(objs);
+    graph.add(Recipe({"hello"}, {"build/main.o", "build/greet.o"},
+                     Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"})));
+
+    // `./bob watch` rebuilds whenever a source changes, and keeps watching when a build fails
+    if (argc > 1 && string(argv[1]) == "watch") {
+        graph.watch([]() { std::cout << "Watching for changes..." << std::endl; });
+    }
+    graph.build();
+}
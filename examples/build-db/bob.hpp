@@ -0,0 +1 @@
+../../bob.hpp
\ No newline at end of file
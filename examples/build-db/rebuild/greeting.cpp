@@ -0,0 +1,5 @@
+#include <string>
+
+std::string greeting() {
+    return "Hello from a rebuilt tool!";
+}
@@ -0,0 +1,13 @@
+#define BOB_IMPLEMENTATION
+// Rebuilds also compile the other sources of the tool, which are only passed when linking
+#define BOB_REBUILD_CMD { "g++", "-std=c++17", "-o", "_PROGRAM_", "_SOURCE_", "greeting.cpp" }
+#include "../bob.hpp"
+
+#include <iostream>
+
+std::string greeting();
+
+int main(int argc, char *argv[]) {
+    GO_REBUILD_YOURSELF(argc, argv);
+    std::cout << greeting() << std::endl;
+}
@@ -0,0 +1,6 @@
+#include "greet.h"
+
+int main(void) {
+    greet("Bob");
+    return 0;
+}
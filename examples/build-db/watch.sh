@@ -0,0 +1,21 @@
+# Breaks a source while `./bob watch` runs, then fixes it again
+./bob watch > watch.log 2>&1 &
+pid=$!
+
+# Waits until the watcher is done with a build for the `n`th time
+wait_for() {
+    until [ "$(grep -c 'Watching for changes' watch.log)" -ge "$1" ]; do sleep 0.1; done
+}
+
+wait_for 1
+echo 'broken' >> src/greet.c
+wait_for 2
+git checkout -q src/greet.c
+sed -i 's/%s!/%s!!/' src/greet.c
+wait_for 3
+kill $pid
+
+# Compiler messages differ between versions, so only bob's own lines are compared
+grep -E '^(CMD|Watching|.*\[ERROR\])' watch.log
+./hello
+git checkout -q src/greet.c
@@ -7,6 +7,43 @@ using namespace std;
 int main(int argc, char* argv[]) {
     GO_REBUILD_YOURSELF(argc, argv);
 
+    // In Pipe mode stdout and stderr can be captured apart, and in both modes a program which
+    // cannot be started fails with 127 like in a shell
+    if (argc > 1 && string(argv[1]) == "pipe") {
+        Cmd both({"sh", "-c", "echo to stdout; echo to stderr >&2"});
+        both.spawn = SpawnMode::Pipe;
+        both.separate_stderr = true;
+        both.capture_output = true;
+        both.run();
+        cout << "stdout: " << both.output_str;
+        cout << "stderr: " << both.error_str;
+
+        for (SpawnMode mode : {SpawnMode::Pty, SpawnMode::Pipe}) {
+            Cmd missing({"./does-not-exist"});
+            missing.spawn = mode;
+            missing.capture_output = true;
+            int exit_code = missing.run();
+            cout << "exit code " << exit_code << ": " << missing.output_str;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // A pipeline reading and writing files, and its exit codes, which follow `set -o pipefail`
+    if (argc > 1 && string(argv[1]) == "pipeline") {
+        Cmd sevens = Cmd({"grep", "7"}) | Cmd({"sort", "-rn"}) | Cmd({"head", "-n", "2"});
+        sevens.stdin_file = "numbers.txt";
+        sevens.stdout_file = "sevens.txt";
+        int exit_code = sevens.run();
+        cout << "exit code " << exit_code << ", sevens.txt:\n" << ifstream("sevens.txt").rdbuf();
+
+        for (Cmd pipeline : {Cmd({"sh", "-c", "exit 3"}) | Cmd({"cat"}),
+                             Cmd({"false"}) | Cmd({"sh", "-c", "exit 2"}) | Cmd({"true"})}) {
+            exit_code = pipeline.run();
+            cout << "exit code " << exit_code << endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
     ensure_installed({"python3"});
 
     Cmd cmd({"python3", "./script.py"});
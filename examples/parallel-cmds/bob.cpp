@@ -10,6 +10,117 @@ using namespace std;
 int main(int argc, char* argv[]) {
     GO_REBUILD_YOURSELF(argc, argv);
 
+    // In-process tasks run next to commands, and a panicking task only fails itself
+    if (argc > 1 && string(argv[1]) == "tasks") {
+        CmdRunner tasks(1);
+        tasks.push(Cmd([](string &output) { output += "Hello from a task\n"; return 0; }, "greet"));
+        tasks.push(Cmd({"echo", "Hello from a command"}));
+        tasks.push(Cmd([](string &) -> int { PANIC("Something went wrong"); }, "panic"));
+        tasks.push(Cmd([](string &) -> int { throw 42; }, "throw"));
+        tasks.run();
+
+        cout << "\nExit codes:\n";
+        for (auto & exit_code : tasks.exit_codes) {
+            cout << "  " << exit_code << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // Hermetic commands go to remote workers once the local slots are busy. Here `fake-ssh.sh`
+    // stands in for ssh, and the slow command is killed on the worker when it times out.
+    if (argc > 1 && string(argv[1]) == "remote") {
+        use_remote_workers({"worker/2"}).ssh = {"sh", "fake-ssh.sh"};
+        CmdRunner runner(1);
+        runner.push(Cmd({"sleep", "1"}));
+
+        Cmd shout({"sh", "-c", "tr a-z A-Z < input.txt > output.txt"});
+        shout.hermetic = true;
+        shout.inputs = {"input.txt"};
+        shout.outputs = {"output.txt"};
+        runner.push(shout);
+
+        Cmd slow({"sh", "-c", "sleep 3; touch late.txt"});
+        slow.hermetic = true;
+        slow.outputs = {"late.txt"};
+        slow.timeout_ms = 500;
+        runner.push(slow);
+        runner.run();
+
+        cout << "\nExit codes:\n";
+        for (auto & exit_code : runner.exit_codes) {
+            cout << "  " << exit_code << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // `./bob output lines|jobs|prefix` prints the output of two overlapping commands: line by
+    // line as it arrives, in one piece per command, or line by line with the command number
+    if (argc > 2 && string(argv[1]) == "output") {
+        string mode = argv[2];
+        CmdRunner runner(2);
+        if (mode == "lines")  runner.output(OutputMode::Lines);
+        if (mode == "jobs")   runner.output(OutputMode::Jobs);
+        if (mode == "prefix") runner.output(OutputMode::Lines, true);
+        runner.push(Cmd({"sh", "-c", "echo one; sleep 1; echo one again"}));
+        runner.push(Cmd({"sh", "-c", "sleep 0.5; echo two"}));
+        runner.run();
+        return EXIT_SUCCESS;
+    }
+
+    // Timeouts, retries and speculative copies. Every command counts its runs in a file, and only
+    // behaves once it ran often enough.
+    if (argc > 1 && string(argv[1]) == "retry") {
+        use_build_db();
+        for (const char *counter : {"flaky.count", "slow.count", "stuck.count"}) fs::remove(counter);
+        auto counted = [](const string &counter, int runs, const string &otherwise) {
+            return Cmd({"sh", "-c", "echo x >> " + counter + "; [ $(wc -l < " + counter + ") -ge " + to_string(runs) + " ] || " + otherwise});
+        };
+
+        // Fails once, then succeeds when it is run again
+        Cmd flaky = counted("flaky.count", 2, "exit 1");
+        flaky.retries = 1;
+        // Hangs once, is killed after the timeout and succeeds when it is run again
+        Cmd stuck = counted("stuck.count", 2, "sleep 5");
+        stuck.timeout_ms = 300;
+        stuck.retries = 1;
+        // Never finishes in time
+        Cmd hangs({"sleep", "5"});
+        hangs.timeout_ms = 300;
+
+        CmdRunner runner(1);
+        runner.push(flaky);
+        runner.push(stuck);
+        runner.push(hangs);
+        runner.run();
+        for (size_t i = 0; i < runner.size(); i++) {
+            cout << "exit code " << runner.exit_codes[i] << ", memory measured: " << (runner.stats[i].max_rss_kb > 0 ? "yes" : "no") << endl;
+        }
+
+        // Quick on its first run, which the build database remembers, and slow on the second. An idle
+        // slot then starts a third copy, which is quick again and wins.
+        Cmd slow = counted("slow.count", 3, "[ $(wc -l < slow.count) -eq 1 ] || sleep 5");
+        slow.speculative = true;
+        for (int run = 0; run < 2; run++) {
+            CmdRunner speculative(2);
+            speculative.push(slow);
+            speculative.run();
+            cout << "exit code " << speculative.exit_codes[0] << endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // Stops starting commands after the second failure
+    if (argc > 1 && string(argv[1]) == "keep-going") {
+        CmdRunner runner(1);
+        runner.keep_going(2);
+        runner.push(Cmd({"false"}));
+        runner.push(Cmd({"echo", "still started"}));
+        runner.push(Cmd({"sh", "-c", "exit 3"}));
+        runner.push(Cmd({"echo", "never started"}));
+        if (!runner.run()) runner.print_failed();
+        return EXIT_SUCCESS;
+    }
+
     ensure_installed({"python3"});
 
     auto runner = CmdRunner(3);
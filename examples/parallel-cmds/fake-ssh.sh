@@ -0,0 +1,5 @@
+# Stands in for ssh in `./bob remote`. Runs the command for the host in `remote/<host>`, which acts
+# as the home directory of the worker, in a session of its own like sshd would.
+dir="remote/$1"
+shift
+mkdir -p "$dir" && cd "$dir" && exec setsid -w sh -c "$*"
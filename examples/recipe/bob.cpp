@@ -7,7 +7,7 @@ using namespace bob;
 const string CC = "gcc";
 const vector<string> CFLAGS = {"-Wall", "-Wextra", "-O2"};
 
-const auto build_objs = Recipe({"./build/main.o", "./build/other.o"}, {"./src/main.c", "./src/other.c"},
+const auto build_objs = Recipe::map({"./build/main.o", "./build/other.o"}, {"./src/main.c", "./src/other.c"},
     [](const vector<path> &inputs, const vector<path> &outputs) {
         assert(inputs.size() == outputs.size());
         mkdirs("./build");
@@ -31,6 +31,22 @@ const auto build_main = Recipe({"main"}, {"./build/main.o", "./build/other.o"},
 int main(int argc, char *argv[]) {
     GO_REBUILD_YOURSELF(argc, argv);
 
-    build_objs.build();
-    build_main.build();
+    // `./bob export` writes the graph for ninja and clangd instead of building it. Only recipes
+    // made from command templates can be exported, so the task making `version.h` is skipped.
+    if (argc > 1 && string(argv[1]) == "export") {
+        Graph commands;
+        commands.add(Recipe::map({"build/main.o", "build/other.o"}, {"src/main.c", "src/other.c"},
+                                 Cmd({CC, "-c", "_INPUTS_", "-o", "_OUTPUTS_"}).push_many(CFLAGS)));
+        commands.add(Recipe({"main"}, {"build/main.o", "build/other.o"}, Cmd({CC, "-o", "_OUTPUTS_", "_INPUTS_"})));
+        commands.add(Recipe({"version.h"}, {"src/main.c"}, Cmd([](string &) { return 0; }, "generate version.h")));
+        commands.write_ninja("build.ninja", Cmd({"./bob", "export"}));
+        commands.write_compile_commands();
+        return 0;
+    }
+
+    // The graph figures out that the objects must be built before `main`
+    Graph graph;
+    graph.add(build_main);
+    graph.add(build_objs);
+    graph.build();
 }
@@ -0,0 +1,31 @@
+#define BOB_IMPLEMENTATION
+#include "bob.hpp"
+
+using namespace std;
+using namespace bob;
+
+int main(int argc, char *argv[]) {
+    GO_REBUILD_YOURSELF(argc, argv);
+
+    // `./bob glob` lists the files some patterns match
+    if (argc > 1 && string(argv[1]) == "glob") {
+        for (const char *pattern : {"src/*.c", "src/[am]*.c", "s?c/*u*", "*.c", "**/*.c", "**/main*"}) {
+            cout << pattern << ":";
+            for (const path &file : glob(pattern)) cout << " " << file.string();
+            cout << endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // The database balances the units by compile time, and tells edited sources from touched ones
+    use_build_db();
+
+    // Four sources in two units. A source edited on its own is split off and compiled by itself.
+    UnityBuild unity(glob("src/*.c"), "build", Cmd({"gcc", "-MMD", "-c", "_INPUTS_", "-o", "_OUTPUTS_"}), 2);
+    Recipe objects = unity.recipe();
+
+    Graph graph;
+    graph.add(objects);
+    graph.add(Recipe({"main"}, objects.outputs, Cmd({"gcc", "-o", "_OUTPUTS_", "_INPUTS_"})));
+    graph.build();
+}
@@ -0,0 +1,10 @@
+#include <stdio.h>
+
+int add(int a, int b);
+int sub(int a, int b);
+int mul(int a, int b);
+
+int main(void) {
+    printf("%d %d %d\n", add(6, 3), sub(6, 3), mul(6, 3));
+    return 0;
+}
@@ -0,0 +1,3 @@
+int sub(int a, int b) {
+    return a - b;
+}